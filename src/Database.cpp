@@ -11,6 +11,8 @@
 #include "KeyPointPersistor.h"
 #include "ShootSegmenter.h"
 
+#include <climits>
+
 
 using namespace cv;
 using namespace std;
@@ -21,12 +23,13 @@ Database::build(
         string &path,
         FeatureMethod &fm,
         bool reuseFeatures,
-        int k,
-        int h, int maxFiles, int maxFilesVocabulary, bool reuseVocabulary, int pca_dim
+        vector<int> &levelK,
+        int h, int maxFiles, int maxFilesVocabulary, bool reuseVocabulary, int pca_dim, int scoring,
+        string &quantizer
 ) {
 
-    Ptr<Database> ret = new Database(path, fm, reuseFeatures, k, h, maxFiles, maxFilesVocabulary, reuseVocabulary,
-                                     pca_dim
+    Ptr<Database> ret = new Database(path, fm, reuseFeatures, levelK, h, maxFiles, maxFilesVocabulary, reuseVocabulary,
+                                     pca_dim, scoring, quantizer
     );
     return ret;
 }
@@ -606,8 +609,9 @@ Database::Database(
         string &path,
         FeatureMethod &fm,
         bool reuseFeatures,
-        int k,
-        int h, int maxFiles, int maxFilesVocabulary, bool reuseVocabulary, int pca_dim
+        vector<int> &levelK,
+        int h, int maxFiles, int maxFilesVocabulary, bool reuseVocabulary, int pca_dim, int scoring,
+        string &quantizer
         //, int maxTrainingFiles
         //,int kmeansAttempts
         //,TermCriteria & crit
@@ -623,6 +627,8 @@ Database::Database(
     _totalDBelems = 0;
     //_segmentVideo = false;
     _segmentVideo = true;
+    _budgetDescriptors = 0;
+    _budgetMillis = 0;
     _maxFiles = maxFiles;
     _reuseVocabulary = reuseVocabulary;
     _maxFilesVocabulary = maxFilesVocabulary;
@@ -682,7 +688,7 @@ Database::Database(
     //Ptr<Feature2D> pDM = fm.getDescriptorExtractor();
     //int useNorm = pDM->defaultNorm();
     int useNorm = fm.getDefaultNorm();
-    buildtree(k, h, useNorm);
+    buildtree(levelK, h, useNorm, scoring, quantizer);
 
 
 }
@@ -719,6 +725,8 @@ Database::Database(string path, bool update) {
 
     _totalFeatures = 0;
     _segmentVideo = false;
+    _budgetDescriptors = 0;
+    _budgetMillis = 0;
 
     FileManager fileMgr(_path);
     checkDirs(fileMgr);
@@ -792,13 +800,13 @@ Database::getFileInfo(int idImage) {
 
 
 void
-Database::buildtree(int k, int h, int useNorm) {
+Database::buildtree(vector<int> &levelK, int h, int useNorm, int scoring, string &quantizer) {
 
 
     if (_maxFiles > 0) {
         _catalog.shrink(_maxFiles);
     }
-    _vt = new VocTree(k, h, _catalog, _path, _reuseVocabulary, useNorm);
+    _vt = new VocTree(levelK, h, _catalog, _path, _reuseVocabulary, useNorm, scoring, quantizer);
 
 
 }
@@ -1033,6 +1041,12 @@ Database::query(int idFile, vector<Matching> &result, int limit) {
 
     DBElem fileInfo = _catalog.get(idFile);
 
+    // indexed files are queried with their stored words, with no descent
+    Mat words;
+    if (readWords(idFile, words)) {
+        _vt->queryWords(words, result, limit);
+        return;
+    }
 
     if (_pMpDescs == NULL) {
         FileManager fm(_path);
@@ -1043,8 +1057,10 @@ Database::query(int idFile, vector<Matching> &result, int limit) {
         _pMpDescs->openRead();
     }
 
-    //_pMpDescs->setRow(1234);
-    _pMpDescs->read(qDescriptors, fileInfo.featuresCount);
+    if (fileInfo.featuresCount > 0) {
+        _pMpDescs->setRow(_featureRows[idFile]);
+        _pMpDescs->read(qDescriptors, fileInfo.featuresCount);
+    }
 
     //cout << "db:running query..." << endl;
     _vt->query(qDescriptors, result, limit);
@@ -1065,6 +1081,45 @@ Database::query(int idFile, vector<Matching> &result, int limit) {
 
 }
 
+bool
+Database::readWords(int idFile, Mat &words) {
+
+    if (_featureRows.size() != (size_t) _catalog.size() + 1) {
+        _featureRows.assign(_catalog.size() + 1, 0);
+        for (int i = 0; i < _catalog.size(); i++) {
+            _featureRows[i + 1] = _featureRows[i] + _catalog.get(i).featuresCount;
+        }
+        _pMpWords.release();
+    }
+
+    if (_pMpWords.empty()) {
+        FileManager fm(_path);
+        string fileWords = fm.file(FileManager::WORDS);
+        _pMpWords = new MatPersistor(fileWords);
+        // the words file of a database indexed by a previous version might be missing or incomplete
+        if (!_pMpWords->exists() || !_pMpWords->openRead() ||
+            _pMpWords->rows() != _featureRows[_catalog.size()]) {
+            return false;
+        }
+    }
+    if (!_pMpWords->isOpen()) {
+        return false;
+    }
+
+    // an image with no descriptors has no rows (its first row might be past the end of the file)
+    int count = _featureRows[idFile + 1] - _featureRows[idFile];
+    if (count == 0) {
+        words.create(0, 1, CV_32S);
+        return true;
+    }
+
+    _pMpWords->setRow(_featureRows[idFile]);
+    _pMpWords->read(words, count);
+    return true;
+
+}
+
+
 void
 Database::query(string &fileName, vector<Matching> &result, int limit) {
 
@@ -1086,6 +1141,9 @@ Database::query(string &fileName,
 
     cout << "query: " << fileName << endl;
 
+    // the time budget covers the whole query, including the features extraction
+    int64 start = getTickCount();
+
     Mat img = readResource(fileName);
 
     if (!img.data) {
@@ -1118,8 +1176,41 @@ Database::query(string &fileName,
          << endl << flush;
 
 
-    cout << "db:running query..." << endl;
-    _vt->query(qDescriptors, result, limit);
+    if (_budgetDescriptors > 0 || _budgetMillis > 0) {
+
+        // keypoints are ranked by response, the strongest ones are quantized first
+        // (descriptors keep their order if they do not match the keypoints)
+        bool ranked = ((int) qKeypoints.size() == qDescriptors.rows);
+        vector<pair<float, int> > order(qDescriptors.rows);
+        for (int i = 0; i < qDescriptors.rows; i++) {
+            order[i] = make_pair(ranked ? -qKeypoints[i].response : 0, i);
+        }
+        sort(order.begin(), order.end());
+
+        int rows = qDescriptors.rows;
+        if (_budgetDescriptors > 0) {
+            rows = min(rows, _budgetDescriptors);
+        }
+        Mat descriptors(rows, qDescriptors.cols, qDescriptors.type());
+        for (int r = 0; r < rows; r++) {
+            qDescriptors.row(order[r].second).copyTo(descriptors.row(r));
+        }
+
+        int64 deadline = LLONG_MAX;
+        if (_budgetMillis > 0) {
+            deadline = start + (int64) (_budgetMillis * getTickFrequency() / 1000);
+        }
+
+        cout << "db:running anytime query..." << endl;
+        int used = _vt->queryAnytime(descriptors, result, limit, deadline);
+        cout << " used " << used << " of " << qDescriptors.rows << " descriptors" << endl;
+
+    } else {
+
+        cout << "db:running query..." << endl;
+        _vt->query(qDescriptors, result, limit);
+
+    }
 
 
     if (_exports) {
@@ -1135,6 +1226,153 @@ Database::query(string &fileName,
 
 }
 
+void
+Database::queryFrame(Mat &frame, VocTree::StreamSession &session, vector<Matching> &result, int limit) {
+
+    result.clear();
+
+    vector<KeyPoint> qKeypoints;
+    Mat qDescriptors;
+    if (!extractFeatures(frame, qKeypoints, qDescriptors) || qDescriptors.rows == 0) {
+        // a frame with no features has no results, the session is kept for the next one
+        return;
+    }
+
+    if (_usePCA) {
+        _pca->project(qDescriptors, qDescriptors);
+    }
+
+    _vt->queryStream(qDescriptors, session, result, limit);
+
+}
+
+
+void
+Database::queryBatch(vector<string> &fileNames, vector<vector<Matching> > &results, int limit) {
+
+    // computes the descriptors of every query file
+    // (files that can not be processed get no descriptors, and therefore no results)
+    vector<Mat> queries(fileNames.size());
+    for (unsigned int i = 0; i < fileNames.size(); i++) {
+
+        string &fileName = fileNames[i];
+        cout << "query: " << fileName << endl;
+
+        Mat img = readResource(fileName);
+        if (!img.data) {
+            cerr << fileName << " can not be read" << endl;
+            continue;
+        }
+
+        vector<KeyPoint> qKeypoints;
+        Mat &qDescriptors = queries[i];
+        if (!extractFeatures(img, qKeypoints, qDescriptors)) {
+            cerr << fileName << " can not be processed" << endl;
+            qDescriptors.release();
+            continue;
+        }
+
+        if (_usePCA && qDescriptors.rows > 0) {
+            _pca->project(qDescriptors, qDescriptors);
+        }
+
+    }
+
+    cout << "db:running batch query..." << endl;
+    _vt->queryBatch(queries, results, limit);
+
+}
+
+
+void
+Database::setScoringLevels(int minLevel, int maxLevel) {
+    _vt->setScoringLevels(minLevel, maxLevel);
+}
+
+
+void
+Database::reportLevels() {
+    _vt->reportLevels();
+}
+
+
+void
+Database::setQueryBudget(int maxDescriptors, double maxMillis) {
+
+    if (maxDescriptors < 0 || maxMillis < 0) {
+        cerr << "invalid query budget" << endl;
+        return;
+    }
+
+    _budgetDescriptors = maxDescriptors;
+    _budgetMillis = maxMillis;
+
+}
+
+
+void
+Database::setBeam(int width, float ratio) {
+    _vt->setBeam(width, ratio);
+}
+
+
+void
+Database::setCascade(int level, int candidates) {
+    _vt->setCascade(level, candidates);
+}
+
+
+bool
+Database::isStreamIncremental() {
+    return _vt->isStreamIncremental();
+}
+
+
+void
+Database::useQuantizedCenters(bool enable) {
+    _vt->useQuantizedCenters(enable);
+}
+
+
+void
+Database::useHnsw(int M, int efConstruction, int ef) {
+    _vt->useHnsw(M, efConstruction, ef);
+}
+
+
+void
+Database::warmQueryContext(int limit) {
+    _vt->warmQueryContext(limit);
+}
+
+
+void
+Database::benchmarkQuantizers(int samples, int M, int efConstruction) {
+
+    FileManager fm(_path);
+    string fileDescriptors = fm.file(FileManager::DESCRIPTORS);
+    MatPersistor mp(fileDescriptors);
+    if (!mp.exists() || !mp.openRead() || mp.rows() == 0) {
+        cerr << "could not read the indexed descriptors " << fileDescriptors << endl;
+        return;
+    }
+
+    // the samples are spread over all the indexed descriptors
+    int rows = mp.rows();
+    samples = min(samples, rows);
+    Mat descriptors(samples, mp.cols(), mp.type());
+    for (int s = 0; s < samples; s++) {
+        Mat row = descriptors.row(s);
+        mp.setRow((int) ((long) s * rows / samples));
+        mp.read(row, 1);
+    }
+    mp.close();
+
+    _vt->benchmarkQuantizers(descriptors, M, efConstruction);
+
+}
+
+
 string
 Database::getPath() {
     return _path;
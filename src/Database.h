@@ -54,17 +54,20 @@ public:
  * @param path path where database is stored on disk
  * @param fm feature method, method to detect and compute descriptors
  * @param reuseFeatures if true, input features wont be computed
- * @param k branch factor for the vocabulary tree
+ * @param levelK branch factor of each level of the vocabulary tree, from the root
+ *        (the last one is used for the deeper levels)
  * @param h maximum height for the vocabulary tree
  * @param maxFiles maximum number files to index, if 0 then all files will be processed
  * @param maxFilesVocabulary maximum number vocabulary files to process, if 0 then all files will be processed
  * @param reuseVocabulary if true, vocabulary features wont be computed
  * @param pca_dim number of dimensions to reduce features using PCA if 0 then disabled.
+ * @param scoring norm used to score the images (see VocTree::SCORING_L1)
+ * @param quantizer quantizer of the descriptors, for indexing and queries (see VocTree::parseQuantizer)
  * @return a pointer to the resulting database
  */
     static Ptr<Database> build(
-            string &path, FeatureMethod &fm, bool reuseFeatures, int k, int h, int maxFiles, int maxFilesVocabulary,
-            bool reuseVocabulary, int pca_dim
+            string &path, FeatureMethod &fm, bool reuseFeatures, vector<int> &levelK, int h, int maxFiles,
+            int maxFilesVocabulary, bool reuseVocabulary, int pca_dim, int scoring, string &quantizer
             //, int maxTrainingFiles
     );
 
@@ -153,6 +156,90 @@ public:
                vector<KeyPoint> &qKeypoints,
                Mat &qDescriptors);
 
+    /**
+     * Performs a query for a frame of a video stream
+     * It wraps the functionality of the vocabulary tree streaming query
+     * @param frame the frame to be queried
+     * @param session streaming session, kept by the caller between the frames of a stream
+     * @param result a vector containing the scoring results
+     * @param limit maximum number of results
+     */
+    void queryFrame(Mat &frame,
+                    VocTree::StreamSession &session,
+                    vector<Matching> &result,
+                    int limit);
+
+    /**
+     * @return true if the frames of a stream are scored incrementally (see VocTree::isStreamIncremental)
+     */
+    bool isStreamIncremental();
+
+    /**
+     * Sets the window of levels of the vocabulary tree used for scoring
+     * @param minLevel first level used for scoring
+     * @param maxLevel last level used for scoring
+     */
+    void setScoringLevels(int minLevel, int maxLevel);
+
+    /**
+     * Displays how much score mass each level of the vocabulary tree contributes
+     */
+    void reportLevels();
+
+    /**
+     * Sets the beam used by the vocabulary tree to quantize the query descriptors
+     * @param width maximum number of nodes kept per level (1 for the greedy descent)
+     * @param ratio maximum distance to a kept node, relative to the closest one (0 for no limit)
+     */
+    void setBeam(int width, float ratio);
+
+    /**
+     * Sets the cascade scoring of the vocabulary tree (see VocTree::setCascade)
+     * @param level last level of the first stage (0 disables the cascade)
+     * @param candidates number of candidates rescored by the second stage
+     */
+    void setCascade(int level, int candidates);
+
+    /**
+     * Enables or disables the 8 bits copy of the vocabulary tree centers used by the descent
+     * @param enable true to use the 8 bits centers
+     */
+    void useQuantizedCenters(bool enable);
+
+    /**
+     * Uses an HNSW graph over the visual words to quantize the queries (see VocTree::useHnsw)
+     * @param M maximum number of neighbors of a word (0 restores the tree descent)
+     * @param efConstruction words explored when the graph is built
+     * @param ef words explored by the queries
+     */
+    void useHnsw(int M, int efConstruction, int ef);
+
+    /**
+     * Allocates the scratch memory of the queries in advance (see VocTree::warmQueryContext)
+     * @param limit maximum number of results of the following queries
+     */
+    void warmQueryContext(int limit);
+
+    /**
+     * Compares the recall and the speed of the quantizers on a sample of the indexed descriptors
+     * (see VocTree::benchmarkQuantizers)
+     * @param samples number of descriptors used
+     * @param M maximum number of neighbors of a word of the HNSW graph
+     * @param efConstruction words explored when the HNSW graph is built
+     */
+    void benchmarkQuantizers(int samples, int M, int efConstruction);
+
+    /**
+     * Performs a query for each one of the given files
+     * It wraps the functionality of the vocabulary tree batch query
+     * @param fileNames files to be queried
+     * @param results a vector containing the scoring results of each file
+     * @param limit maximum number of results per file
+     */
+    void queryBatch(vector<string> &fileNames,
+                    vector<vector<Matching> > &results,
+                    int limit);
+
 
     /**
      * This structure is used for exporting purposes. see exportResults method
@@ -206,6 +293,16 @@ public:
         return _exports;
     }
 
+    /**
+     * Sets a budget for the queries of files. When a budget is set, the query descriptors are used
+     * in order of keypoint response (the strongest first), up to maxDescriptors of them, and no more
+     * descriptors are quantized once maxMillis have passed since the query started.
+     * The images are always scored with the descriptors used, so queries return a valid result.
+     * @param maxDescriptors maximum number of descriptors used by a query (0 for no limit)
+     * @param maxMillis time budget of a query in milliseconds (0 for no limit)
+     */
+    void setQueryBudget(int maxDescriptors, double maxMillis);
+
     /**
      * @return the indexed files catalog
      */
@@ -217,6 +314,10 @@ private:
 
     bool _exports;
     bool _segmentVideo;
+
+    // query budget (see setQueryBudget), 0 for no limit
+    int _budgetDescriptors;
+    double _budgetMillis;
     long _totalFeatures;
     int _totalDBelems;
 
@@ -256,15 +357,15 @@ private:
 
     // maxFiles: maximum number of files to process (for features generation)
     // maxTrainingFiles: maximum number of files to include in vocabulary
-    Database(string &path, FeatureMethod &fm, bool reuseFeatures, int k, int h, int maxFiles, int maxFilesVocabulary,
-             bool reuseVocabulary, int pca_dim
+    Database(string &path, FeatureMethod &fm, bool reuseFeatures, vector<int> &levelK, int h, int maxFiles,
+             int maxFilesVocabulary, bool reuseVocabulary, int pca_dim, int scoring, string &quantizer
             //,int kmeansAttempts
             //,TermCriteria & term
     );
 
     Database(string path, bool update);
 
-    void buildtree(int k, int h, int useNorm);
+    void buildtree(vector<int> &levelK, int h, int useNorm, int scoring, string &quantizer);
 
     void processInput(bool reuseFeatures, bool forVocabulary);
 
@@ -312,6 +413,19 @@ private:
 
     Ptr<MatPersistor> _pMpDescs;
 
+    // words of the indexed descriptors (see FileManager::WORDS), and the first descriptor row
+    // of each indexed file (featureRows[idFile])
+    Ptr<MatPersistor> _pMpWords;
+    vector<int> _featureRows;
+
+    /**
+     * Reads the visual words of an indexed file, when the words file has them
+     * @param idFile the id of the indexed file
+     * @param words output words, one row per descriptor
+     * @return true if the words were read
+     */
+    bool readWords(int idFile, Mat &words);
+
     bool _usePCA;
     int _pca_dim;
     Ptr<PCA> _pca;
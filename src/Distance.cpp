@@ -0,0 +1,807 @@
+//Copyright (C) 2016, Esteban Uriza <estebanuri@gmail.com>
+//This program is free software: you can use, modify and/or
+//redistribute it under the terms of the GNU General Public
+//License as published by the Free Software Foundation, either
+//version 3 of the License, or (at your option) any later
+//version. You should have received a copy of this license along
+//this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include "Distance.h"
+
+#include <iostream>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define DISTANCE_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+
+bool Distance::_initialized = false;
+Distance::L2SqrKernel Distance::_l2Sqr = NULL;
+string Distance::_l2SqrName;
+Distance::L2SqrU8Kernel Distance::_l2SqrU8 = NULL;
+
+Distance::HammingKernel Distance::_hamming = NULL;
+Distance::HammingKernel Distance::_hamming32 = NULL;
+Distance::HammingKernel Distance::_hamming64 = NULL;
+string Distance::_hammingName;
+
+
+static inline float l2SqrScalar(const float *a, const float *b, int dim) {
+
+    // four independent accumulators let the compiler pipeline the loop
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int i = 0;
+    for (; i + 4 <= dim; i += 4) {
+        float d0 = a[i + 0] - b[i + 0];
+        float d1 = a[i + 1] - b[i + 1];
+        float d2 = a[i + 2] - b[i + 2];
+        float d3 = a[i + 3] - b[i + 3];
+        s0 += d0 * d0;
+        s1 += d1 * d1;
+        s2 += d2 * d2;
+        s3 += d3 * d3;
+    }
+    for (; i < dim; i++) {
+        float d = a[i] - b[i];
+        s0 += d * d;
+    }
+    return (s0 + s1) + (s2 + s3);
+
+}
+
+
+static float l2SqrU8Scalar(const float *a, const unsigned char *codes, const float *weights, int dim) {
+
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int i = 0;
+    for (; i + 4 <= dim; i += 4) {
+        float d0 = a[i + 0] - codes[i + 0];
+        float d1 = a[i + 1] - codes[i + 1];
+        float d2 = a[i + 2] - codes[i + 2];
+        float d3 = a[i + 3] - codes[i + 3];
+        s0 += weights[i + 0] * d0 * d0;
+        s1 += weights[i + 1] * d1 * d1;
+        s2 += weights[i + 2] * d2 * d2;
+        s3 += weights[i + 3] * d3 * d3;
+    }
+    for (; i < dim; i++) {
+        float d = a[i] - codes[i];
+        s0 += weights[i] * d * d;
+    }
+    return (s0 + s1) + (s2 + s3);
+
+}
+
+
+// loads 8 bytes as a 64-bit word (descriptor rows are not guaranteed to be aligned)
+static inline unsigned long long loadWord(const unsigned char *p) {
+    unsigned long long w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+
+static inline int hammingScalar(const unsigned char *a, const unsigned char *b, int bytes) {
+
+    int dist = 0;
+    int i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        dist += __builtin_popcountll(loadWord(a + i) ^ loadWord(b + i));
+    }
+    for (; i < bytes; i++) {
+        dist += __builtin_popcount((unsigned int) (a[i] ^ b[i]));
+    }
+    return dist;
+
+}
+
+
+#ifdef DISTANCE_X86
+
+__attribute__((target("sse4.2")))
+static inline float l2SqrSSE42(const float *a, const float *b, int dim) {
+
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+    }
+    for (; i + 4 <= dim; i += 4) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+    }
+    acc0 = _mm_add_ps(acc0, acc1);
+    acc0 = _mm_hadd_ps(acc0, acc0);
+    acc0 = _mm_hadd_ps(acc0, acc0);
+    float sum = _mm_cvtss_f32(acc0);
+    for (; i < dim; i++) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+
+}
+
+
+__attribute__((target("avx2,fma")))
+static inline float l2SqrAVX2(const float *a, const float *b, int dim) {
+
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 8 <= dim; i += 8) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+    }
+    acc0 = _mm256_add_ps(acc0, acc1);
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+    s = _mm_hadd_ps(s, s);
+    s = _mm_hadd_ps(s, s);
+    float sum = _mm_cvtss_f32(s);
+    for (; i < dim; i++) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+
+}
+
+
+// 8 bits codes kernels: codes are widened to 32 bits integers and converted to floats
+
+__attribute__((target("sse4.2")))
+static float l2SqrU8SSE42(const float *a, const unsigned char *codes, const float *weights, int dim) {
+
+    __m128 acc = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= dim; i += 4) {
+        int word;
+        memcpy(&word, codes + i, sizeof(word));
+        __m128 c = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(word)));
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), c);
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(weights + i), _mm_mul_ps(d, d)));
+    }
+    acc = _mm_hadd_ps(acc, acc);
+    acc = _mm_hadd_ps(acc, acc);
+    float sum = _mm_cvtss_f32(acc);
+    for (; i < dim; i++) {
+        float d = a[i] - codes[i];
+        sum += weights[i] * d * d;
+    }
+    return sum;
+
+}
+
+
+__attribute__((target("avx2,fma")))
+static float l2SqrU8AVX2(const float *a, const unsigned char *codes, const float *weights, int dim) {
+
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *) (codes + i));
+        __m256 c0 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(c));
+        __m256 c1 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(c, 8)));
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), c0);
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), c1);
+        acc0 = _mm256_fmadd_ps(_mm256_mul_ps(d0, d0), _mm256_loadu_ps(weights + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_mul_ps(d1, d1), _mm256_loadu_ps(weights + i + 8), acc1);
+    }
+    acc0 = _mm256_add_ps(acc0, acc1);
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+    s = _mm_hadd_ps(s, s);
+    s = _mm_hadd_ps(s, s);
+    float sum = _mm_cvtss_f32(s);
+    for (; i < dim; i++) {
+        float d = a[i] - codes[i];
+        sum += weights[i] * d * d;
+    }
+    return sum;
+
+}
+
+
+// some GCC versions report false uninitialized warnings within the AVX-512 intrinsics headers
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+static inline float l2SqrAVX512(const float *a, const float *b, int dim) {
+
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 16 <= dim; i += 16) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+    }
+    if (i < dim) {
+        // masked loads for the tail, lanes outside dim are zero on both sides
+        __mmask16 mask = (__mmask16) ((1u << (dim - i)) - 1);
+        __m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+        acc1 = _mm512_fmadd_ps(d0, d0, acc1);
+    }
+    acc0 = _mm512_add_ps(acc0, acc1);
+    acc0 = _mm512_add_ps(acc0, _mm512_shuffle_f32x4(acc0, acc0, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc0 = _mm512_add_ps(acc0, _mm512_shuffle_f32x4(acc0, acc0, _MM_SHUFFLE(2, 3, 0, 1)));
+    __m128 s = _mm512_castps512_ps128(acc0);
+    s = _mm_hadd_ps(s, s);
+    s = _mm_hadd_ps(s, s);
+    return _mm_cvtss_f32(s);
+
+}
+
+__attribute__((target("avx512f")))
+static float l2SqrU8AVX512(const float *a, const unsigned char *codes, const float *weights, int dim) {
+
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        __m512 c = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *) (codes + i))));
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), c);
+        acc = _mm512_fmadd_ps(_mm512_mul_ps(d, d), _mm512_loadu_ps(weights + i), acc);
+    }
+    acc = _mm512_add_ps(acc, _mm512_shuffle_f32x4(acc, acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm512_add_ps(acc, _mm512_shuffle_f32x4(acc, acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    __m128 s = _mm512_castps512_ps128(acc);
+    s = _mm_hadd_ps(s, s);
+    s = _mm_hadd_ps(s, s);
+    float sum = _mm_cvtss_f32(s);
+    for (; i < dim; i++) {
+        float d = a[i] - codes[i];
+        sum += weights[i] * d * d;
+    }
+    return sum;
+
+}
+
+#pragma GCC diagnostic pop
+
+
+// Hamming kernels using the popcnt instruction on 64-bit words.
+// the fixed width versions are fully unrolled.
+
+__attribute__((target("popcnt")))
+static inline int hammingPopcnt(const unsigned char *a, const unsigned char *b, int bytes) {
+
+    long long dist = 0;
+    int i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        dist += _mm_popcnt_u64(loadWord(a + i) ^ loadWord(b + i));
+    }
+    for (; i < bytes; i++) {
+        dist += _mm_popcnt_u32((unsigned int) (a[i] ^ b[i]));
+    }
+    return (int) dist;
+
+}
+
+__attribute__((target("popcnt")))
+static int hammingPopcnt32(const unsigned char *a, const unsigned char *b, int) {
+
+    return (int) (_mm_popcnt_u64(loadWord(a + 0) ^ loadWord(b + 0)) +
+                  _mm_popcnt_u64(loadWord(a + 8) ^ loadWord(b + 8)) +
+                  _mm_popcnt_u64(loadWord(a + 16) ^ loadWord(b + 16)) +
+                  _mm_popcnt_u64(loadWord(a + 24) ^ loadWord(b + 24)));
+
+}
+
+__attribute__((target("popcnt")))
+static int hammingPopcnt64(const unsigned char *a, const unsigned char *b, int) {
+
+    return (int) (_mm_popcnt_u64(loadWord(a + 0) ^ loadWord(b + 0)) +
+                  _mm_popcnt_u64(loadWord(a + 8) ^ loadWord(b + 8)) +
+                  _mm_popcnt_u64(loadWord(a + 16) ^ loadWord(b + 16)) +
+                  _mm_popcnt_u64(loadWord(a + 24) ^ loadWord(b + 24)) +
+                  _mm_popcnt_u64(loadWord(a + 32) ^ loadWord(b + 32)) +
+                  _mm_popcnt_u64(loadWord(a + 40) ^ loadWord(b + 40)) +
+                  _mm_popcnt_u64(loadWord(a + 48) ^ loadWord(b + 48)) +
+                  _mm_popcnt_u64(loadWord(a + 56) ^ loadWord(b + 56)));
+
+}
+
+
+// AVX2 Hamming kernels: per-nibble population count with a vpshufb lookup table,
+// and horizontal byte sums with vpsadbw.
+
+__attribute__((target("avx2")))
+static inline __m256i popcount256(__m256i v) {
+
+    const __m256i lookup = _mm256_setr_epi8(
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowMask = _mm256_set1_epi8(0x0f);
+
+    __m256i lo = _mm256_and_si256(v, lowMask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), lowMask);
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+
+    // sums the bytes into four 64-bit counters
+    return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+
+}
+
+__attribute__((target("avx2")))
+static inline int sum256(__m256i v) {
+
+    __m128i s = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));
+    return (int) _mm_cvtsi128_si64(s);
+
+}
+
+__attribute__((target("avx2,popcnt")))
+static inline int hammingAVX2(const unsigned char *a, const unsigned char *b, int bytes) {
+
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 32 <= bytes; i += 32) {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (a + i)),
+                                     _mm256_loadu_si256((const __m256i *) (b + i)));
+        acc = _mm256_add_epi64(acc, popcount256(x));
+    }
+    int dist = sum256(acc);
+    for (; i + 8 <= bytes; i += 8) {
+        dist += (int) _mm_popcnt_u64(loadWord(a + i) ^ loadWord(b + i));
+    }
+    for (; i < bytes; i++) {
+        dist += _mm_popcnt_u32((unsigned int) (a[i] ^ b[i]));
+    }
+    return dist;
+
+}
+
+__attribute__((target("avx2")))
+static int hammingAVX2_32(const unsigned char *a, const unsigned char *b, int) {
+
+    __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) a),
+                                 _mm256_loadu_si256((const __m256i *) b));
+    return sum256(popcount256(x));
+
+}
+
+__attribute__((target("avx2")))
+static int hammingAVX2_64(const unsigned char *a, const unsigned char *b, int) {
+
+    __m256i x0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) a),
+                                  _mm256_loadu_si256((const __m256i *) b));
+    __m256i x1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (a + 32)),
+                                  _mm256_loadu_si256((const __m256i *) (b + 32)));
+    return sum256(_mm256_add_epi64(popcount256(x0), popcount256(x1)));
+
+}
+
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+
+// AVX-512 Hamming kernels using the native 64-bit lanes population count (VPOPCNTQ).
+
+__attribute__((target("avx512f,avx512vl,avx512vpopcntdq")))
+static inline int sum512(__m512i v) {
+
+    __m256i s = _mm256_add_epi64(_mm512_castsi512_si256(v), _mm512_extracti64x4_epi64(v, 1));
+    __m128i t = _mm_add_epi64(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+    t = _mm_add_epi64(t, _mm_unpackhi_epi64(t, t));
+    return (int) _mm_cvtsi128_si64(t);
+
+}
+
+__attribute__((target("avx512f,avx512vl,avx512vpopcntdq,popcnt")))
+static inline int hammingAVX512(const unsigned char *a, const unsigned char *b, int bytes) {
+
+    __m512i acc = _mm512_setzero_si512();
+    int i = 0;
+    for (; i + 64 <= bytes; i += 64) {
+        __m512i x = _mm512_xor_si512(_mm512_loadu_si512((const void *) (a + i)),
+                                     _mm512_loadu_si512((const void *) (b + i)));
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+    }
+    int dist = sum512(acc);
+    for (; i + 8 <= bytes; i += 8) {
+        dist += (int) _mm_popcnt_u64(loadWord(a + i) ^ loadWord(b + i));
+    }
+    for (; i < bytes; i++) {
+        dist += _mm_popcnt_u32((unsigned int) (a[i] ^ b[i]));
+    }
+    return dist;
+
+}
+
+__attribute__((target("avx512f,avx512vl,avx512vpopcntdq")))
+static int hammingAVX512_32(const unsigned char *a, const unsigned char *b, int) {
+
+    __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) a),
+                                 _mm256_loadu_si256((const __m256i *) b));
+    __m256i cnt = _mm256_popcnt_epi64(x);
+    __m128i t = _mm_add_epi64(_mm256_castsi256_si128(cnt), _mm256_extracti128_si256(cnt, 1));
+    t = _mm_add_epi64(t, _mm_unpackhi_epi64(t, t));
+    return (int) _mm_cvtsi128_si64(t);
+
+}
+
+__attribute__((target("avx512f,avx512vl,avx512vpopcntdq")))
+static int hammingAVX512_64(const unsigned char *a, const unsigned char *b, int) {
+
+    __m512i x = _mm512_xor_si512(_mm512_loadu_si512((const void *) a),
+                                 _mm512_loadu_si512((const void *) b));
+    return sum512(_mm512_popcnt_epi64(x));
+
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+
+// Closest child kernels, specialized for a branch factor K and a descriptor size D (or BYTES)
+// known at compile time: the distance kernels are inlined with a constant size, so their loops
+// and the scan of the children are fully unrolled.
+
+template <int K, int D>
+static int closestL2Scalar(const float *q, const unsigned char *centers, size_t step) {
+
+    int best = 0;
+    float minDist = l2SqrScalar(q, (const float *) centers, D);
+    for (int i = 1; i < K; i++) {
+        float d = l2SqrScalar(q, (const float *) (centers + i * step), D);
+        if (d < minDist) {
+            minDist = d;
+            best = i;
+        }
+    }
+    return best;
+
+}
+
+template <int K, int BYTES>
+static int closestHammingScalar(const unsigned char *q, const unsigned char *centers, size_t step) {
+
+    int best = 0;
+    int minDist = hammingScalar(q, centers, BYTES);
+    for (int i = 1; i < K; i++) {
+        int d = hammingScalar(q, centers + i * step, BYTES);
+        if (d < minDist) {
+            minDist = d;
+            best = i;
+        }
+    }
+    return best;
+
+}
+
+
+#ifdef DISTANCE_X86
+
+template <int K, int D>
+__attribute__((target("sse4.2")))
+static int closestL2SSE42(const float *q, const unsigned char *centers, size_t step) {
+
+    int best = 0;
+    float minDist = l2SqrSSE42(q, (const float *) centers, D);
+    for (int i = 1; i < K; i++) {
+        float d = l2SqrSSE42(q, (const float *) (centers + i * step), D);
+        if (d < minDist) {
+            minDist = d;
+            best = i;
+        }
+    }
+    return best;
+
+}
+
+template <int K, int D>
+__attribute__((target("avx2,fma")))
+static int closestL2AVX2(const float *q, const unsigned char *centers, size_t step) {
+
+    int best = 0;
+    float minDist = l2SqrAVX2(q, (const float *) centers, D);
+    for (int i = 1; i < K; i++) {
+        float d = l2SqrAVX2(q, (const float *) (centers + i * step), D);
+        if (d < minDist) {
+            minDist = d;
+            best = i;
+        }
+    }
+    return best;
+
+}
+
+template <int K, int BYTES>
+__attribute__((target("popcnt")))
+static int closestHammingPopcnt(const unsigned char *q, const unsigned char *centers, size_t step) {
+
+    int best = 0;
+    int minDist = hammingPopcnt(q, centers, BYTES);
+    for (int i = 1; i < K; i++) {
+        int d = hammingPopcnt(q, centers + i * step, BYTES);
+        if (d < minDist) {
+            minDist = d;
+            best = i;
+        }
+    }
+    return best;
+
+}
+
+template <int K, int BYTES>
+__attribute__((target("avx2,popcnt")))
+static int closestHammingAVX2(const unsigned char *q, const unsigned char *centers, size_t step) {
+
+    int best = 0;
+    int minDist = hammingAVX2(q, centers, BYTES);
+    for (int i = 1; i < K; i++) {
+        int d = hammingAVX2(q, centers + i * step, BYTES);
+        if (d < minDist) {
+            minDist = d;
+            best = i;
+        }
+    }
+    return best;
+
+}
+
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+template <int K, int D>
+__attribute__((target("avx512f")))
+static int closestL2AVX512(const float *q, const unsigned char *centers, size_t step) {
+
+    int best = 0;
+    float minDist = l2SqrAVX512(q, (const float *) centers, D);
+    for (int i = 1; i < K; i++) {
+        float d = l2SqrAVX512(q, (const float *) (centers + i * step), D);
+        if (d < minDist) {
+            minDist = d;
+            best = i;
+        }
+    }
+    return best;
+
+}
+
+template <int K, int BYTES>
+__attribute__((target("avx512f,avx512vl,avx512vpopcntdq,popcnt")))
+static int closestHammingAVX512(const unsigned char *q, const unsigned char *centers, size_t step) {
+
+    int best = 0;
+    int minDist = hammingAVX512(q, centers, BYTES);
+    for (int i = 1; i < K; i++) {
+        int d = hammingAVX512(q, centers + i * step, BYTES);
+        if (d < minDist) {
+            minDist = d;
+            best = i;
+        }
+    }
+    return best;
+
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+
+// configurations with specialized closest child kernels, for each instruction set.
+// SIFT (128 floats) and PCA-64 / SURF (64 floats) with K = 10, ORB (32 bytes) with K = 10 and K = 16.
+// Other configurations use the generic kernels.
+
+struct ClosestL2Entry {
+    int k;
+    int dim;
+    Distance::ClosestL2Kernel kernel;
+};
+
+struct ClosestHammingEntry {
+    int k;
+    int bytes;
+    Distance::ClosestHammingKernel kernel;
+};
+
+static const int CLOSEST_ENTRIES = 2;
+
+static const ClosestL2Entry closestL2ScalarTable[CLOSEST_ENTRIES] = {
+        {10, 128, closestL2Scalar<10, 128>},
+        {10, 64, closestL2Scalar<10, 64>}
+};
+
+static const ClosestHammingEntry closestHammingScalarTable[CLOSEST_ENTRIES] = {
+        {10, 32, closestHammingScalar<10, 32>},
+        {16, 32, closestHammingScalar<16, 32>}
+};
+
+#ifdef DISTANCE_X86
+
+static const ClosestL2Entry closestL2SSE42Table[CLOSEST_ENTRIES] = {
+        {10, 128, closestL2SSE42<10, 128>},
+        {10, 64, closestL2SSE42<10, 64>}
+};
+
+static const ClosestL2Entry closestL2AVX2Table[CLOSEST_ENTRIES] = {
+        {10, 128, closestL2AVX2<10, 128>},
+        {10, 64, closestL2AVX2<10, 64>}
+};
+
+static const ClosestL2Entry closestL2AVX512Table[CLOSEST_ENTRIES] = {
+        {10, 128, closestL2AVX512<10, 128>},
+        {10, 64, closestL2AVX512<10, 64>}
+};
+
+static const ClosestHammingEntry closestHammingPopcntTable[CLOSEST_ENTRIES] = {
+        {10, 32, closestHammingPopcnt<10, 32>},
+        {16, 32, closestHammingPopcnt<16, 32>}
+};
+
+static const ClosestHammingEntry closestHammingAVX2Table[CLOSEST_ENTRIES] = {
+        {10, 32, closestHammingAVX2<10, 32>},
+        {16, 32, closestHammingAVX2<16, 32>}
+};
+
+static const ClosestHammingEntry closestHammingAVX512Table[CLOSEST_ENTRIES] = {
+        {10, 32, closestHammingAVX512<10, 32>},
+        {16, 32, closestHammingAVX512<16, 32>}
+};
+
+#endif
+
+// tables of the selected instruction sets
+static const ClosestL2Entry *closestL2Table = NULL;
+static const ClosestHammingEntry *closestHammingTable = NULL;
+
+
+void
+Distance::init() {
+
+    if (_initialized) {
+        return;
+    }
+
+    _l2Sqr = l2SqrScalar;
+    _l2SqrU8 = l2SqrU8Scalar;
+    _l2SqrName = "scalar";
+    closestL2Table = closestL2ScalarTable;
+
+#ifdef DISTANCE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        _l2Sqr = l2SqrAVX512;
+        _l2SqrU8 = l2SqrU8AVX512;
+        closestL2Table = closestL2AVX512Table;
+        _l2SqrName = "avx512";
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        _l2Sqr = l2SqrAVX2;
+        _l2SqrU8 = l2SqrU8AVX2;
+        closestL2Table = closestL2AVX2Table;
+        _l2SqrName = "avx2";
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        _l2Sqr = l2SqrSSE42;
+        _l2SqrU8 = l2SqrU8SSE42;
+        closestL2Table = closestL2SSE42Table;
+        _l2SqrName = "sse4.2";
+    }
+#endif
+
+    _hamming = hammingScalar;
+    _hamming32 = hammingScalar;
+    _hamming64 = hammingScalar;
+    _hammingName = "scalar";
+    closestHammingTable = closestHammingScalarTable;
+
+#ifdef DISTANCE_X86
+    if (__builtin_cpu_supports("avx512vpopcntdq") && __builtin_cpu_supports("avx512vl")) {
+        _hamming = hammingAVX512;
+        _hamming32 = hammingAVX512_32;
+        _hamming64 = hammingAVX512_64;
+        _hammingName = "avx512";
+        closestHammingTable = closestHammingAVX512Table;
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        _hamming = hammingAVX2;
+        _hamming32 = hammingAVX2_32;
+        _hamming64 = hammingAVX2_64;
+        _hammingName = "avx2";
+        closestHammingTable = closestHammingAVX2Table;
+    } else if (__builtin_cpu_supports("popcnt")) {
+        _hamming = hammingPopcnt;
+        _hamming32 = hammingPopcnt32;
+        _hamming64 = hammingPopcnt64;
+        _hammingName = "popcnt";
+        closestHammingTable = closestHammingPopcntTable;
+    }
+#endif
+
+    _initialized = true;
+
+    cout << "L2 distance kernel: " << _l2SqrName << endl;
+    cout << "Hamming distance kernel: " << _hammingName << endl;
+
+}
+
+
+Distance::L2SqrKernel
+Distance::l2Sqr() {
+    init();
+    return _l2Sqr;
+}
+
+
+Distance::L2SqrU8Kernel
+Distance::l2SqrU8() {
+    init();
+    return _l2SqrU8;
+}
+
+
+string
+Distance::l2SqrName() {
+    init();
+    return _l2SqrName;
+}
+
+
+Distance::HammingKernel
+Distance::hamming(int bytes) {
+    init();
+    if (bytes == 32) {
+        return _hamming32;
+    }
+    if (bytes == 64) {
+        return _hamming64;
+    }
+    return _hamming;
+}
+
+
+string
+Distance::hammingName() {
+    init();
+    return _hammingName;
+}
+
+
+Distance::ClosestL2Kernel
+Distance::closestL2(int k, int dim) {
+    init();
+    for (int e = 0; e < CLOSEST_ENTRIES; e++) {
+        if (closestL2Table[e].k == k && closestL2Table[e].dim == dim) {
+            return closestL2Table[e].kernel;
+        }
+    }
+    return NULL;
+}
+
+
+Distance::ClosestHammingKernel
+Distance::closestHamming(int k, int bytes) {
+    init();
+    for (int e = 0; e < CLOSEST_ENTRIES; e++) {
+        if (closestHammingTable[e].k == k && closestHammingTable[e].bytes == bytes) {
+            return closestHammingTable[e].kernel;
+        }
+    }
+    return NULL;
+}
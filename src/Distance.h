@@ -0,0 +1,143 @@
+//Copyright (C) 2016, Esteban Uriza <estebanuri@gmail.com>
+//This program is free software: you can use, modify and/or
+//redistribute it under the terms of the GNU General Public
+//License as published by the Free Software Foundation, either
+//version 3 of the License, or (at your option) any later
+//version. You should have received a copy of this license along
+//this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef DISTANCE_H_
+#define DISTANCE_H_
+
+#include <string>
+#include <cstddef>
+
+using namespace std;
+
+
+class Distance {
+
+public:
+
+    /**
+     * Distance class provides the distance kernels used in the hot loops of the application
+     * (for example, the vocabulary tree descent).
+     * Kernels work on raw pointers, avoiding the overhead of building temporary Mat headers.
+     * Several implementations of each kernel are compiled (scalar, SSE4.2 / popcnt, AVX2, AVX-512),
+     * and the fastest one supported by the running CPU is selected once at startup.
+     */
+
+    /**
+     * Squared L2 distance kernel
+     * @param a first vector
+     * @param b second vector
+     * @param dim number of elements of each vector
+     * @return the squared L2 distance between a and b
+     */
+    typedef float (*L2SqrKernel)(const float *a, const float *b, int dim);
+
+    /**
+     * Weighted squared L2 distance kernel between a float vector and a vector of 8 bits codes
+     * (used with the quantized centers, a code only takes a byte per dimension)
+     * @param a first vector, expressed in code units
+     * @param codes second vector
+     * @param weights weight of each dimension (the squared code scale)
+     * @param dim number of elements of each vector
+     * @return the sum of weights[i] * (a[i] - codes[i])^2
+     */
+    typedef float (*L2SqrU8Kernel)(const float *a, const unsigned char *codes, const float *weights, int dim);
+
+    /**
+     * Hamming distance kernel for binary descriptors
+     * @param a first descriptor
+     * @param b second descriptor
+     * @param bytes number of bytes of each descriptor
+     * @return the number of bits that differ between a and b
+     */
+    typedef int (*HammingKernel)(const unsigned char *a, const unsigned char *b, int bytes);
+
+    /**
+     * Closest child kernel for float descriptors (squared L2 distance)
+     * @param q query descriptor
+     * @param centers first center of the (contiguous) children
+     * @param step distance in bytes between two consecutive centers
+     * @return the index of the closest child (0 to K - 1)
+     */
+    typedef int (*ClosestL2Kernel)(const float *q, const unsigned char *centers, size_t step);
+
+    /**
+     * Closest child kernel for binary descriptors (Hamming distance)
+     * @param q query descriptor
+     * @param centers first center of the (contiguous) children
+     * @param step distance in bytes between two consecutive centers
+     * @return the index of the closest child (0 to K - 1)
+     */
+    typedef int (*ClosestHammingKernel)(const unsigned char *q, const unsigned char *centers, size_t step);
+
+    /**
+     * Detects the CPU features and selects the kernels to be used.
+     * It is safe to call it several times, selection is done only once.
+     */
+    static void init();
+
+    /**
+     * @return the squared L2 kernel selected for the running CPU
+     */
+    static L2SqrKernel l2Sqr();
+
+    /**
+     * @return the name of the selected squared L2 kernel (scalar, sse4.2, avx2 or avx512)
+     */
+    static string l2SqrName();
+
+    /**
+     * @return the weighted squared L2 kernel for 8 bits codes selected for the running CPU
+     */
+    static L2SqrU8Kernel l2SqrU8();
+
+    /**
+     * Returns the Hamming kernel selected for the running CPU and the given descriptor size.
+     * Fixed width kernels are used for 32 bytes (ORB, BRIEF) and 64 bytes (BRISK, FREAK) descriptors.
+     * @param bytes number of bytes of the descriptors that will be compared
+     * @return the Hamming kernel
+     */
+    static HammingKernel hamming(int bytes);
+
+    /**
+     * @return the name of the selected Hamming kernel (scalar, popcnt, avx2 or avx512)
+     */
+    static string hammingName();
+
+    /**
+     * Returns a closest child kernel specialized (at compile time) for the given branch factor
+     * and dimension, for the running CPU.
+     * @param k branch factor
+     * @param dim number of elements of the descriptors
+     * @return the specialized kernel, or NULL if the configuration has no specialization
+     */
+    static ClosestL2Kernel closestL2(int k, int dim);
+
+    /**
+     * Returns a closest child kernel specialized (at compile time) for the given branch factor
+     * and descriptor size, for the running CPU.
+     * @param k branch factor
+     * @param bytes number of bytes of the descriptors
+     * @return the specialized kernel, or NULL if the configuration has no specialization
+     */
+    static ClosestHammingKernel closestHamming(int k, int bytes);
+
+private:
+
+    static bool _initialized;
+    static L2SqrKernel _l2Sqr;
+    static string _l2SqrName;
+    static L2SqrU8Kernel _l2SqrU8;
+
+    static HammingKernel _hamming;
+    static HammingKernel _hamming32;
+    static HammingKernel _hamming64;
+    static string _hammingName;
+
+};
+
+#endif /* DISTANCE_H_ */
@@ -9,6 +9,7 @@
 #include "MatPersistor.h"
 
 #include "KMeans.h"
+#include "Distance.h"
 
 #include <set>
 #include <list>
@@ -285,6 +286,12 @@ int setLabels(
 
     Mat expanded(acum.rows, acum.cols, acum.type());
 
+    // for binary descriptors uses the popcount kernels instead of cv::norm
+    Distance::HammingKernel hamming = NULL;
+    if (normType == NORM_HAMMING && data.type() == CV_8U) {
+        hamming = Distance::hamming(data.cols);
+    }
+
 
     for (int lbl = 0; lbl < dataRows; lbl++) {
 
@@ -294,7 +301,12 @@ int setLabels(
         // looks for the closest center
         for (int c = 0; c < centers.rows; c++) {
 
-            float distance = norm(data.row(lbl), centers.row(c), normType);
+            float distance;
+            if (hamming != NULL) {
+                distance = hamming(data.ptr<uchar>(lbl), centers.ptr<uchar>(c), data.cols);
+            } else {
+                distance = norm(data.row(lbl), centers.row(c), normType);
+            }
 
             if (c == 0 || distance < minDistance) {
 
@@ -70,6 +70,8 @@ FileManager::name(int idFile) {
     if (idFile == VOCABULARY_DESCRIPTORS) return "vocabulary_descriptors.bin";
     if (idFile == VOCABULARY_KEYPOINTS) return "vocabulary_keypoints.bin";
 
+    if (idFile == WORDS) return "words.bin";
+
     return "";
 
 }
@@ -44,6 +44,9 @@ public:
     static const int VOCABULARY_DESCRIPTORS = 9;
     static const int VOCABULARY_KEYPOINTS = 10;
 
+    // leaf (visual word) of each indexed descriptor, in the same order as DESCRIPTORS
+    static const int WORDS = 11;
+
     /**
      * FileManager constructor
      * @param path path to the root directory where database is defined
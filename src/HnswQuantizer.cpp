@@ -0,0 +1,505 @@
+// Copyright (C) 2016, Esteban Uriza <estebanuri@gmail.com>
+// This program is free software: you can use, modify and/or
+// redistribute it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later
+// version. You should have received a copy of this license along
+// this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include "HnswQuantizer.h"
+
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+
+using namespace cv;
+using namespace std;
+
+// format of the graph file
+static const int HNSW_FORMAT = 1;
+
+// seed of the random layers, so that a graph is the same each time it is built
+static const uint64 HNSW_SEED = 0x9E3779B97F4A7C15ULL;
+
+
+static bool writeInts(FILE *pFile, const vector<int> &values) {
+
+    int count = values.size();
+    bool ok = fwrite(&count, sizeof(count), 1, pFile) == 1;
+    if (ok && count > 0) {
+        ok = fwrite(&values[0], sizeof(int), count, pFile) == (size_t) count;
+    }
+    return ok;
+
+}
+
+
+static bool readInts(FILE *pFile, vector<int> &values) {
+
+    int count;
+    if (fread(&count, sizeof(count), 1, pFile) != 1 || count < 0) {
+        return false;
+    }
+    values.resize(count);
+    return count == 0 || fread(&values[0], sizeof(int), count, pFile) == (size_t) count;
+
+}
+
+
+HnswQuantizer::HnswQuantizer(const Mat &centers, const vector<int> &rows) :
+        _centers(centers), _rows(rows), _words(rows.size()), _l2Sqr(NULL), _hamming(NULL),
+        _M(0), _efConstruction(0), _ef(1), _entry(-1), _maxLevel(-1) {
+
+    Distance::init();
+    if (centers.type() == CV_32F) {
+        _l2Sqr = Distance::l2Sqr();
+    } else {
+        _hamming = Distance::hamming(centers.cols);
+    }
+
+}
+
+
+string
+HnswQuantizer::name() {
+    return "hnsw";
+}
+
+
+int
+HnswQuantizer::getM() {
+    return _M;
+}
+
+
+int
+HnswQuantizer::getEfConstruction() {
+    return _efConstruction;
+}
+
+
+void
+HnswQuantizer::setEf(int ef) {
+    _ef = max(ef, 1);
+}
+
+
+const uchar *
+HnswQuantizer::center(int word) {
+    return _centers.ptr(_rows[word]);
+}
+
+
+float
+HnswQuantizer::distance(const uchar *a, const uchar *b) {
+
+    if (_l2Sqr != NULL) {
+        return _l2Sqr((const float *) a, (const float *) b, _centers.cols);
+    }
+    return (float) _hamming(a, b, _centers.cols);
+
+}
+
+
+int
+HnswQuantizer::maxLinks(int level) {
+    return (level == 0) ? 2 * _M : _M;
+}
+
+
+int *
+HnswQuantizer::links(int word, int level) {
+
+    if (level == 0) {
+        return &_links0[word * (2 * _M + 1)];
+    }
+    return &_upperLinks[word][(level - 1) * (_M + 1)];
+
+}
+
+
+void
+HnswQuantizer::searchGreedy(const uchar *q, int &entry, float &entryDist, int level) {
+
+    bool moved = true;
+    while (moved) {
+
+        moved = false;
+        int *neighbors = links(entry, level);
+        for (int i = 1; i <= neighbors[0]; i++) {
+            float d = distance(q, center(neighbors[i]));
+            if (d < entryDist) {
+                entryDist = d;
+                entry = neighbors[i];
+                moved = true;
+            }
+        }
+
+    }
+
+}
+
+
+void
+HnswQuantizer::searchLayer(const uchar *q, int entry, float entryDist, int ef, int level,
+                           SearchScratch &scratch, vector<Candidate> &result) {
+
+    // the scratch of a graph with other words, or a wrapped around epoch, starts from clear stamps
+    if ((int) scratch.stamps.size() != _words || ++scratch.epoch == 0) {
+        scratch.stamps.assign(_words, 0);
+        scratch.epoch = 1;
+    }
+    unsigned int epoch = scratch.epoch;
+
+    // frontier is a min heap (the closest word on top), result a max heap (the farthest one on top)
+    vector<Candidate> &frontier = scratch.frontier;
+    frontier.clear();
+    result.clear();
+
+    scratch.stamps[entry] = epoch;
+    frontier.push_back(Candidate(entryDist, entry));
+    result.push_back(Candidate(entryDist, entry));
+
+    while (!frontier.empty()) {
+
+        pop_heap(frontier.begin(), frontier.end(), greater<Candidate>());
+        Candidate current = frontier.back();
+        frontier.pop_back();
+
+        // the closest word to expand is farther than all the kept ones
+        if ((int) result.size() >= ef && current.first > result.front().first) {
+            break;
+        }
+
+        int *neighbors = links(current.second, level);
+        for (int i = 1; i <= neighbors[0]; i++) {
+
+            int n = neighbors[i];
+            if (scratch.stamps[n] == epoch) {
+                continue;
+            }
+            scratch.stamps[n] = epoch;
+
+            float d = distance(q, center(n));
+            if ((int) result.size() < ef || d < result.front().first) {
+
+                frontier.push_back(Candidate(d, n));
+                push_heap(frontier.begin(), frontier.end(), greater<Candidate>());
+
+                result.push_back(Candidate(d, n));
+                push_heap(result.begin(), result.end());
+                if ((int) result.size() > ef) {
+                    pop_heap(result.begin(), result.end());
+                    result.pop_back();
+                }
+
+            }
+
+        }
+
+    }
+
+    sort_heap(result.begin(), result.end());
+
+}
+
+
+void
+HnswQuantizer::selectNeighbors(const vector<Candidate> &candidates, int maxCount, vector<int> &selected) {
+
+    selected.clear();
+    for (unsigned int c = 0; c < candidates.size() && (int) selected.size() < maxCount; c++) {
+
+        const uchar *pCandidate = center(candidates[c].second);
+        bool keep = true;
+        for (unsigned int s = 0; s < selected.size() && keep; s++) {
+            keep = distance(pCandidate, center(selected[s])) >= candidates[c].first;
+        }
+        if (keep) {
+            selected.push_back(candidates[c].second);
+        }
+
+    }
+
+}
+
+
+void
+HnswQuantizer::addLink(int word, int neighbor, int level) {
+
+    int *neighbors = links(word, level);
+    int maxCount = maxLinks(level);
+    if (neighbors[0] < maxCount) {
+        neighbors[++neighbors[0]] = neighbor;
+        return;
+    }
+
+    // the word is full: its neighbors are selected again among the current ones and the new one
+    const uchar *pWord = center(word);
+    vector<Candidate> candidates;
+    candidates.push_back(Candidate(distance(pWord, center(neighbor)), neighbor));
+    for (int i = 1; i <= neighbors[0]; i++) {
+        candidates.push_back(Candidate(distance(pWord, center(neighbors[i])), neighbors[i]));
+    }
+    sort(candidates.begin(), candidates.end());
+
+    vector<int> selected;
+    selectNeighbors(candidates, maxCount, selected);
+    neighbors[0] = selected.size();
+    for (unsigned int s = 0; s < selected.size(); s++) {
+        neighbors[1 + s] = selected[s];
+    }
+
+}
+
+
+void
+HnswQuantizer::insert(int word, int level) {
+
+    _levels[word] = level;
+    if (level > 0) {
+        _upperLinks[word].assign(level * (_M + 1), 0);
+    }
+
+    if (_entry < 0) {
+        _entry = word;
+        _maxLevel = level;
+        return;
+    }
+
+    const uchar *q = center(word);
+    int entry = _entry;
+    float entryDist = distance(q, center(entry));
+
+    // goes down greedily to the top layer of the new word
+    for (int l = _maxLevel; l > level; l--) {
+        searchGreedy(q, entry, entryDist, l);
+    }
+
+    vector<Candidate> nearest;
+    vector<int> selected;
+    for (int l = min(level, _maxLevel); l >= 0; l--) {
+
+        searchLayer(q, entry, entryDist, _efConstruction, l, _buildScratch, nearest);
+        selectNeighbors(nearest, _M, selected);
+
+        int *neighbors = links(word, l);
+        neighbors[0] = selected.size();
+        for (unsigned int s = 0; s < selected.size(); s++) {
+            neighbors[1 + s] = selected[s];
+            addLink(selected[s], word, l);
+        }
+
+        // the closest word found is the entry of the next layer
+        entry = nearest[0].second;
+        entryDist = nearest[0].first;
+
+    }
+
+    if (level > _maxLevel) {
+        _entry = word;
+        _maxLevel = level;
+    }
+
+}
+
+
+void
+HnswQuantizer::limitParams(int &M, int &efConstruction) {
+    M = max(M, 2);
+    efConstruction = max(efConstruction, M);
+}
+
+
+void
+HnswQuantizer::build(int M, int efConstruction) {
+
+    limitParams(M, efConstruction);
+    _M = M;
+    _efConstruction = efConstruction;
+
+    _levels.assign(_words, 0);
+    _links0.assign(_words * (2 * _M + 1), 0);
+    _upperLinks.assign(_words, vector<int>());
+    _entry = -1;
+    _maxLevel = -1;
+
+    _buildScratch.stamps.clear();
+
+    // the top layer of a word follows a geometric distribution, with mL = 1 / ln(M)
+    RNG rng(HNSW_SEED);
+    double mL = 1.0 / log((double) _M);
+
+    cout << "building hnsw graph (" << _words << " words, M " << _M
+         << ", efConstruction " << _efConstruction << ")" << endl;
+    cout << "progress: " << flush;
+    int lastProgress = -1;
+    for (int w = 0; w < _words; w++) {
+
+        double u = rng.uniform(0.0, 1.0);
+        int level = (int) (-log(1.0 - u) * mL);
+        insert(w, level);
+
+        int progress = (int) (100L * (w + 1) / _words);
+        if (progress != lastProgress && progress % 10 == 0) {
+            cout << progress << "% " << flush;
+            lastProgress = progress;
+        }
+
+    }
+    cout << endl;
+
+    // the build scratch is not needed by the searches
+    vector<unsigned int>().swap(_buildScratch.stamps);
+    vector<Candidate>().swap(_buildScratch.frontier);
+
+}
+
+
+Ptr<Quantizer::Scratch>
+HnswQuantizer::createScratch() {
+    return Ptr<Scratch>(new SearchScratch());
+}
+
+
+void
+HnswQuantizer::quantize(Mat &descriptors, int rowStart, int rowEnd, int *words, Scratch &scratch) {
+
+    if (_entry < 0) {
+        for (int r = rowStart; r < rowEnd; r++) {
+            words[r] = -1;
+        }
+        return;
+    }
+
+    // each worker has its own visited marks, so that disjoint ranges can be quantized concurrently
+    SearchScratch &search = static_cast<SearchScratch &>(scratch);
+    vector<Candidate> &nearest = search.nearest;
+
+    for (int r = rowStart; r < rowEnd; r++) {
+
+        const uchar *q = descriptors.ptr(r);
+        int entry = _entry;
+        float entryDist = distance(q, center(entry));
+        for (int l = _maxLevel; l > 0; l--) {
+            searchGreedy(q, entry, entryDist, l);
+        }
+
+        searchLayer(q, entry, entryDist, _ef, 0, search, nearest);
+        words[r] = nearest[0].second;
+
+    }
+
+}
+
+
+bool
+HnswQuantizer::store(string &fileName) {
+
+    FILE *pFile = fopen(fileName.c_str(), "wb");
+    if (pFile == NULL) {
+        cerr << "could not write the hnsw graph " << fileName << endl;
+        return false;
+    }
+
+    int header[] = {HNSW_FORMAT, _words, _centers.cols, _M, _efConstruction, _entry, _maxLevel};
+    bool ok = fwrite(header, sizeof(header), 1, pFile) == 1;
+    ok = ok && writeInts(pFile, _levels);
+    ok = ok && writeInts(pFile, _links0);
+    for (int w = 0; w < _words && ok; w++) {
+        if (_levels[w] > 0) {
+            ok = writeInts(pFile, _upperLinks[w]);
+        }
+    }
+    fclose(pFile);
+
+    if (!ok) {
+        cerr << "could not write the hnsw graph " << fileName << endl;
+    }
+    return ok;
+
+}
+
+
+bool
+HnswQuantizer::load(string &fileName) {
+
+    FILE *pFile = fopen(fileName.c_str(), "rb");
+    if (pFile == NULL) {
+        return false;
+    }
+
+    int header[7];
+    bool ok = fread(header, sizeof(header), 1, pFile) == 1;
+
+    // a graph built for other words is not used
+    ok = ok && header[0] == HNSW_FORMAT && header[1] == _words && header[2] == _centers.cols && header[3] > 0;
+
+    vector<int> levels;
+    vector<int> links0;
+    vector<vector<int> > upperLinks(_words);
+    ok = ok && readInts(pFile, levels) && (int) levels.size() == _words;
+    ok = ok && readInts(pFile, links0) && links0.size() == (size_t) _words * (2 * header[3] + 1);
+    for (int w = 0; w < _words && ok; w++) {
+        if (levels[w] > 0) {
+            ok = readInts(pFile, upperLinks[w]) && (int) upperLinks[w].size() == levels[w] * (header[3] + 1);
+        }
+    }
+    fclose(pFile);
+
+    // a truncated or foreign file could have the right sizes with words or layers out of range
+    if (!ok || !validate(header[3], header[5], header[6], levels, links0, upperLinks)) {
+        return false;
+    }
+
+    _M = header[3];
+    _efConstruction = header[4];
+    _entry = header[5];
+    _maxLevel = header[6];
+    _levels.swap(levels);
+    _links0.swap(links0);
+    _upperLinks.swap(upperLinks);
+    return true;
+
+}
+
+
+bool
+HnswQuantizer::validate(int M, int entry, int maxLevel, const vector<int> &levels,
+                        const vector<int> &links0, const vector<vector<int> > &upperLinks) {
+
+    // an empty graph has no entry, otherwise the entry is on the top layer
+    if (entry < 0 || _words == 0) {
+        return entry == -1 && maxLevel == -1;
+    }
+    if (entry >= _words || maxLevel < 0 || levels[entry] != maxLevel) {
+        return false;
+    }
+
+    for (int w = 0; w < _words; w++) {
+
+        if (levels[w] < 0 || levels[w] > maxLevel) {
+            return false;
+        }
+
+        // each list is the number of neighbors followed by the neighbors, which must be on the layer
+        for (int l = 0; l <= levels[w]; l++) {
+            int maxCount = (l == 0) ? 2 * M : M;
+            const int *neighbors = (l == 0) ? &links0[w * (2 * M + 1)] : &upperLinks[w][(l - 1) * (M + 1)];
+            if (neighbors[0] < 0 || neighbors[0] > maxCount) {
+                return false;
+            }
+            for (int i = 1; i <= neighbors[0]; i++) {
+                int n = neighbors[i];
+                if (n < 0 || n >= _words || levels[n] < l) {
+                    return false;
+                }
+            }
+        }
+
+    }
+
+    return true;
+
+}
@@ -0,0 +1,238 @@
+// Copyright (C) 2016, Esteban Uriza <estebanuri@gmail.com>
+// This program is free software: you can use, modify and/or
+// redistribute it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later
+// version. You should have received a copy of this license along
+// this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HNSWQUANTIZER_H_
+#define HNSWQUANTIZER_H_
+
+#include <stdio.h>
+#include <vector>
+
+#include "Quantizer.h"
+#include "Distance.h"
+
+using namespace cv;
+using namespace std;
+
+
+class HnswQuantizer : public Quantizer {
+
+public:
+
+    /**
+     * HnswQuantizer class finds the approximate nearest word of a descriptor with a hierarchical
+     * navigable small world graph (HNSW, Malkov and Yashunin) built over the centers of the words.
+     * Each word is a node of the base layer, and a random subset of them (decreasing exponentially)
+     * is also on each upper layer. A search goes greedily through the upper layers and then
+     * explores the base layer keeping the ef closest words found. The cost grows with the logarithm
+     * of the number of words, so it suits large flat vocabularies (a one level tree, for example
+     * -vtp 1000000:1) where comparing a descriptor with all the words is too slow.
+     *
+     * The centers are shared with the given matrix, they are not copied.
+     */
+
+    /**
+     * HnswQuantizer constructor (the graph must be built or loaded before quantizing)
+     * @param centers matrix with the centers (CV_32F compared with the L2 distance, or CV_8U compared
+     *        with the Hamming distance)
+     * @param rows row of centers of each word (word i is centers.row(rows[i]))
+     */
+    HnswQuantizer(const Mat &centers, const vector<int> &rows);
+
+    /**
+     * Builds the graph
+     * @param M maximum number of neighbors of a word on the upper layers (2 * M on the base layer)
+     * @param efConstruction words explored when the neighbors of a new word are searched
+     */
+    void build(int M, int efConstruction);
+
+    /**
+     * Applies the limits of the graph parameters, the values a graph built with them has
+     * @param M maximum number of neighbors of a word, at least 2
+     * @param efConstruction words explored when the graph is built, at least M
+     */
+    static void limitParams(int &M, int &efConstruction);
+
+    /**
+     * Sets the number of words explored by the searches on the base layer
+     * (higher values improve the recall at the cost of a slower search)
+     * @param ef words explored (at least 1)
+     */
+    void setEf(int ef);
+
+    /**
+     * @return a new scratch with the visited marks of the searches (see Quantizer)
+     */
+    Ptr<Scratch> createScratch();
+
+    /**
+     * Finds the approximate nearest word of a range of descriptors (see Quantizer)
+     */
+    void quantize(Mat &descriptors, int rowStart, int rowEnd, int *words, Scratch &scratch);
+
+    /**
+     * @return "hnsw"
+     */
+    string name();
+
+    /**
+     * @return the parameter M of the graph (0 if it is not built)
+     */
+    int getM();
+
+    /**
+     * @return the parameter efConstruction of the graph (0 if it is not built)
+     */
+    int getEfConstruction();
+
+    /**
+     * Writes the graph to a binary file
+     * @param fileName output file
+     * @return true if it was written
+     */
+    bool store(string &fileName);
+
+    /**
+     * Reads the graph from a binary file
+     * @param fileName input file
+     * @return true if it was read, and it has the same number of words as the quantizer
+     */
+    bool load(string &fileName);
+
+private:
+
+    // (distance, word) pairs
+    typedef pair<float, int> Candidate;
+
+    // scratch memory of the searches: a word is visited if its stamp is the current epoch,
+    // frontier is the heap of the words to be expanded (the closest first) and nearest the closest
+    // words found. Stamps are only cleared when the epoch wraps around
+    class SearchScratch : public Scratch {
+    public:
+        vector<unsigned int> stamps;
+        unsigned int epoch;
+        vector<Candidate> frontier;
+        vector<Candidate> nearest;
+        SearchScratch() : epoch(0) {}
+    };
+
+    Mat _centers;
+    vector<int> _rows;
+    int _words;
+
+    // distance kernels (one of them is NULL)
+    Distance::L2SqrKernel _l2Sqr;
+    Distance::HammingKernel _hamming;
+
+    int _M;
+    int _efConstruction;
+    int _ef;
+
+    // top layer of each word, entry word of the searches and its layer
+    vector<int> _levels;
+    int _entry;
+    int _maxLevel;
+
+    // neighbors on the base layer: for each word, the number of neighbors followed by 2 * M slots
+    vector<int> _links0;
+
+    // neighbors on the upper layers: for each word with a top layer l > 0, l lists of
+    // the number of neighbors followed by M slots (layers 1 to l)
+    vector<vector<int> > _upperLinks;
+
+    // scratch used by the build
+    SearchScratch _buildScratch;
+
+    /**
+     * @param word word
+     * @return the pointer to the center of the word
+     */
+    const uchar *center(int word);
+
+    /**
+     * @param a first vector
+     * @param b second vector
+     * @return the distance between a and b (squared L2 or Hamming)
+     */
+    float distance(const uchar *a, const uchar *b);
+
+    /**
+     * @param word word
+     * @param level layer
+     * @return the neighbors list of a word on a layer (count followed by the neighbors)
+     */
+    int *links(int word, int level);
+
+    /**
+     * @param level layer
+     * @return the maximum number of neighbors of a word on that layer
+     */
+    int maxLinks(int level);
+
+    /**
+     * Greedy search on a layer: moves to the closest neighbor until there is no closer one
+     * @param q query vector
+     * @param entry starting word, replaced by the closest word found
+     * @param entryDist distance from q to entry, updated with the entry
+     * @param level layer
+     */
+    void searchGreedy(const uchar *q, int &entry, float &entryDist, int level);
+
+    /**
+     * Best first search on a layer, keeping the ef closest words found
+     * @param q query vector
+     * @param entry starting word
+     * @param entryDist distance from q to entry
+     * @param ef number of words kept
+     * @param level layer
+     * @param scratch visited marks
+     * @param result output closest words, sorted by distance
+     */
+    void searchLayer(const uchar *q, int entry, float entryDist, int ef, int level,
+                     SearchScratch &scratch, vector<Candidate> &result);
+
+    /**
+     * Selects the neighbors of a word among the candidates (heuristic of the HNSW paper):
+     * a candidate is kept if it is closer to the word than to the neighbors already kept,
+     * which spreads the neighbors in different directions
+     * @param candidates candidates sorted by distance to the word
+     * @param maxCount maximum number of neighbors
+     * @param selected output neighbors
+     */
+    void selectNeighbors(const vector<Candidate> &candidates, int maxCount, vector<int> &selected);
+
+    /**
+     * Adds a link from a word to another one, pruning the neighbors of the word when it is full
+     * @param word word
+     * @param neighbor new neighbor
+     * @param level layer
+     */
+    void addLink(int word, int neighbor, int level);
+
+    /**
+     * Inserts a word in the graph
+     * @param word word
+     * @param level top layer of the word
+     */
+    void insert(int word, int level);
+
+    /**
+     * Checks that a graph read from a file only refers to existing words and layers
+     * @param M maximum number of neighbors of a word
+     * @param entry entry word
+     * @param maxLevel layer of the entry word
+     * @param levels top layer of each word
+     * @param links0 neighbors on the base layer
+     * @param upperLinks neighbors on the upper layers
+     * @return true if the graph is consistent
+     */
+    bool validate(int M, int entry, int maxLevel, const vector<int> &levels,
+                  const vector<int> &links0, const vector<vector<int> > &upperLinks);
+
+};
+
+#endif /* HNSWQUANTIZER_H_ */
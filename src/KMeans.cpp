@@ -1,5 +1,6 @@
 
 #include "KMeans.h"
+#include "Distance.h"
 
 #include <iostream>
 
@@ -148,6 +149,12 @@ static int setLabels(
 
     Mat expanded(acum.rows, acum.cols, acum.type());
 
+    // for binary descriptors uses the popcount kernels instead of cv::norm
+    Distance::HammingKernel hamming = NULL;
+    if (normType == NORM_HAMMING && data.type() == CV_8U) {
+        hamming = Distance::hamming(data.cols);
+    }
+
     for (int lbl = 0; lbl < data.rows; lbl++) {
 
         int closest = 0;
@@ -158,7 +165,12 @@ static int setLabels(
 
             //cout << "distance ";
             //cout << data.type() << " vs " << centers.type() << endl;
-            double distance = norm(data.row(lbl), centers.row(c), normType);
+            double distance;
+            if (hamming != NULL) {
+                distance = hamming(data.ptr<uchar>(lbl), centers.ptr<uchar>(c), data.cols);
+            } else {
+                distance = norm(data.row(lbl), centers.row(c), normType);
+            }
             //cout << distance << endl;
             //cout << "distance" << distance << endl;
 
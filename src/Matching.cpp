@@ -7,6 +7,8 @@ Matching::Matching() {
     score = 2;
 }
 
-Matching::~Matching() {
+Matching::Matching(int id, double score) {
+    this->id = id;
+    this->score = score;
 }
 
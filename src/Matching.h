@@ -40,9 +40,14 @@ public:
     Matching();
 
     /**
-     * Matching destructor
+     * Matching constructor
+     * @param id the id of the file element
+     * @param score the resulting score
      */
-    virtual ~Matching();
+    Matching(int id, double score);
+
+    // Matching has no virtual destructor, so that results are plain structures
+    // (no vtable pointer per element)
 
 };
 
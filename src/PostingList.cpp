@@ -0,0 +1,577 @@
+//Copyright (C) 2016, Esteban Uriza <estebanuri@gmail.com>
+//This program is free software: you can use, modify and/or
+//redistribute it under the terms of the GNU General Public
+//License as published by the Free Software Foundation, either
+//version 3 of the License, or (at your option) any later
+//version. You should have received a copy of this license along
+//this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include "PostingList.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#define POSTINGS_SSE2
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+
+// maximum quantized value
+static const float QUANT_MAX = 65535.0f;
+
+const int PostingList::BLOCK;
+
+
+PostingList::PostingList() {
+    _size = 0;
+    _scale = 0;
+    _maxValue = 0;
+    _dense = false;
+    _idRange = 0;
+}
+
+
+// quantizes a value with the given scale. Positive values are kept at least 1:
+// the dense layout stores the absent images as 0, so a posting must not round to it
+// (and both layouts give the same values)
+static inline unsigned short quantize(float value, float scale) {
+    float q = (scale > 0) ? floor(value / scale + 0.5f) : 0;
+    if (value > 0 && q < 1) {
+        q = 1;
+    }
+    return (unsigned short) min(q, QUANT_MAX);
+}
+
+
+void
+PostingList::encode(const vector<Posting> &postings, int idRange) {
+
+    int n = postings.size();
+
+    _size = n;
+    _blocks.clear();
+    _data.clear();
+
+    // a dense value takes 2 bytes per image id, a sparse posting at least 3 bytes
+    _dense = (n > 0 && idRange > 0 && 2 * (long) idRange <= 3 * (long) n);
+    _idRange = _dense ? idRange : 0;
+
+    float maxValue = 0;
+    for (int i = 0; i < n; i++) {
+        if (postings[i].value > maxValue) {
+            maxValue = postings[i].value;
+        }
+    }
+    _scale = (maxValue > 0) ? (maxValue / QUANT_MAX) : 0;
+    _maxValue = 0;
+
+    if (_dense) {
+
+        _data.assign(_idRange * sizeof(unsigned short), 0);
+        unsigned char *pValues = &_data[0];
+        for (int i = 0; i < n; i++) {
+            unsigned short value = quantize(postings[i].value, _scale);
+            memcpy(pValues + 2 * postings[i].idFile, &value, 2);
+        }
+
+        for (int firstId = 0; firstId < _idRange; firstId += BLOCK) {
+
+            BlockHeader hdr;
+            hdr.firstId = firstId;
+            hdr.offset = firstId * sizeof(unsigned short);
+            hdr.width = 0;
+            hdr.count = min(BLOCK, _idRange - firstId);
+            hdr.maxValue = 0;
+            for (int i = 0; i < hdr.count; i++) {
+                unsigned short value;
+                memcpy(&value, pValues + hdr.offset + 2 * i, 2);
+                hdr.maxValue = max(hdr.maxValue, value);
+            }
+            _maxValue = max(_maxValue, hdr.maxValue);
+
+            _blocks.push_back(hdr);
+
+        }
+
+        return;
+
+    }
+
+    _blocks.reserve((n + BLOCK - 1) / BLOCK);
+    _data.reserve(n * 3);
+
+    for (int start = 0; start < n; start += BLOCK) {
+
+        int count = min(BLOCK, n - start);
+
+        // the deltas width is the smallest one that fits all the deltas of the block
+        unsigned int maxDelta = 0;
+        for (int i = start + 1; i < start + count; i++) {
+            unsigned int delta = postings[i].idFile - postings[i - 1].idFile;
+            if (delta > maxDelta) {
+                maxDelta = delta;
+            }
+        }
+
+        BlockHeader hdr;
+        hdr.firstId = postings[start].idFile;
+        hdr.offset = _data.size();
+        hdr.width = (maxDelta < 0x100) ? 1 : ((maxDelta < 0x10000) ? 2 : 4);
+        hdr.count = count;
+        hdr.maxValue = 0;
+
+        _data.resize(_data.size() + count * (hdr.width + sizeof(unsigned short)));
+        unsigned char *pDeltas = &_data[hdr.offset];
+        unsigned char *pValues = pDeltas + count * hdr.width;
+
+        for (int i = 0; i < count; i++) {
+
+            const Posting &posting = postings[start + i];
+
+            unsigned int delta = (i == 0) ? 0 : (posting.idFile - postings[start + i - 1].idFile);
+            if (hdr.width == 1) {
+                unsigned char d = delta;
+                memcpy(pDeltas + i, &d, 1);
+            } else if (hdr.width == 2) {
+                unsigned short d = delta;
+                memcpy(pDeltas + 2 * i, &d, 2);
+            } else {
+                memcpy(pDeltas + 4 * i, &delta, 4);
+            }
+
+            unsigned short value = quantize(posting.value, _scale);
+            memcpy(pValues + 2 * i, &value, 2);
+
+            if (value > hdr.maxValue) {
+                hdr.maxValue = value;
+            }
+
+        }
+
+        if (hdr.maxValue > _maxValue) {
+            _maxValue = hdr.maxValue;
+        }
+
+        _blocks.push_back(hdr);
+
+    }
+
+    // releases the memory reserved in excess
+    vector<unsigned char>(_data).swap(_data);
+
+}
+
+
+void
+PostingList::decode(vector<Posting> &postings) const {
+
+    postings.clear();
+    postings.reserve(_size);
+
+    int ids[BLOCK];
+    float values[BLOCK];
+    for (int b = 0; b < blocks(); b++) {
+        int count = decodeBlock(b, ids, values);
+        for (int i = 0; i < count; i++) {
+            Posting posting;
+            posting.idFile = ids[i];
+            posting.value = values[i];
+            postings.push_back(posting);
+        }
+    }
+
+}
+
+
+int
+PostingList::decodeBlock(int block, int *ids, float *values) const {
+
+    const BlockHeader &hdr = _blocks[block];
+
+    if (_dense) {
+        // only the present images (not null values) are returned
+        const unsigned char *pValues = &_data[hdr.offset];
+        int n = 0;
+        for (int i = 0; i < hdr.count; i++) {
+            unsigned short value;
+            memcpy(&value, pValues + 2 * i, 2);
+            if (value != 0) {
+                ids[n] = hdr.firstId + i;
+                values[n] = value * _scale;
+                n++;
+            }
+        }
+        return n;
+    }
+
+    const unsigned char *pDeltas = &_data[hdr.offset];
+    int count = hdr.count;
+    int width = hdr.width;
+    const unsigned char *pValues = pDeltas + count * width;
+
+    int i = 0;
+
+#ifdef POSTINGS_SSE2
+
+    // four postings per step: deltas are widened to 32 bits and prefix summed,
+    // values are widened and converted to float
+    __m128i zero = _mm_setzero_si128();
+    __m128i base = _mm_set1_epi32(hdr.firstId);
+    __m128 scale = _mm_set1_ps(_scale);
+
+    for (; i + 4 <= count; i += 4) {
+
+        __m128i d;
+        if (width == 1) {
+            int w;
+            memcpy(&w, pDeltas + i, 4);
+            d = _mm_cvtsi32_si128(w);
+            d = _mm_unpacklo_epi8(d, zero);
+            d = _mm_unpacklo_epi16(d, zero);
+        } else if (width == 2) {
+            d = _mm_loadl_epi64((const __m128i *) (pDeltas + 2 * i));
+            d = _mm_unpacklo_epi16(d, zero);
+        } else {
+            d = _mm_loadu_si128((const __m128i *) (pDeltas + 4 * i));
+        }
+
+        d = _mm_add_epi32(d, _mm_slli_si128(d, 4));
+        d = _mm_add_epi32(d, _mm_slli_si128(d, 8));
+        d = _mm_add_epi32(d, base);
+        _mm_storeu_si128((__m128i *) (ids + i), d);
+        base = _mm_shuffle_epi32(d, _MM_SHUFFLE(3, 3, 3, 3));
+
+        __m128i v = _mm_loadl_epi64((const __m128i *) (pValues + 2 * i));
+        v = _mm_unpacklo_epi16(v, zero);
+        _mm_storeu_ps(values + i, _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+
+    }
+
+#endif
+
+    int id = (i == 0) ? hdr.firstId : ids[i - 1];
+    for (; i < count; i++) {
+
+        unsigned int delta;
+        if (width == 1) {
+            delta = pDeltas[i];
+        } else if (width == 2) {
+            unsigned short d;
+            memcpy(&d, pDeltas + 2 * i, 2);
+            delta = d;
+        } else {
+            memcpy(&delta, pDeltas + 4 * i, 4);
+        }
+        id += delta;
+        ids[i] = id;
+
+        unsigned short value;
+        memcpy(&value, pValues + 2 * i, 2);
+        values[i] = value * _scale;
+
+    }
+
+    return count;
+
+}
+
+
+int
+PostingList::seek(int idFile) const {
+
+    // looks for the last block starting at or before idFile
+    int block;
+    if (_dense) {
+        block = min(idFile / BLOCK, blocks() - 1);
+    } else {
+        int lo = 0;
+        int hi = blocks();
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (_blocks[mid].firstId <= idFile) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        block = lo - 1;
+    }
+    if (block < 0) {
+        return 0;
+    }
+
+    int ids[BLOCK];
+    float values[BLOCK];
+    int count = decodeBlock(block, ids, values);
+    int pos = 0;
+    while (pos < count && ids[pos] < idFile) {
+        pos++;
+    }
+
+    // if every id of the block is lower, the next block starts after idFile
+    return (pos < count) ? (block * BLOCK + pos) : ((block + 1) * BLOCK);
+
+}
+
+
+int
+PostingList::end() const {
+    return blocks() * BLOCK;
+}
+
+
+bool
+PostingList::isDense() const {
+    return _dense;
+}
+
+
+void
+PostingList::addMin(int firstId, int endId, float q, float *acc) const {
+
+    endId = min(endId, _idRange);
+    const unsigned char *pValues = _data.empty() ? NULL : &_data[0];
+    int i = firstId;
+
+#ifdef POSTINGS_SSE2
+
+    // eight values per step: widened to 32 bits, converted to float and scaled
+    __m128i zero = _mm_setzero_si128();
+    __m128 scale = _mm_set1_ps(_scale);
+    __m128 vq = _mm_set1_ps(q);
+
+    for (; i + 8 <= endId; i += 8) {
+
+        __m128i v = _mm_loadu_si128((const __m128i *) (pValues + 2 * i));
+        __m128 lo = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)), scale);
+        __m128 hi = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)), scale);
+
+        float *pAcc = acc + (i - firstId);
+        _mm_storeu_ps(pAcc, _mm_add_ps(_mm_loadu_ps(pAcc), _mm_min_ps(lo, vq)));
+        _mm_storeu_ps(pAcc + 4, _mm_add_ps(_mm_loadu_ps(pAcc + 4), _mm_min_ps(hi, vq)));
+
+    }
+
+#endif
+
+    for (; i < endId; i++) {
+        unsigned short value;
+        memcpy(&value, pValues + 2 * i, 2);
+        acc[i - firstId] += min(q, value * _scale);
+    }
+
+}
+
+
+void
+PostingList::addProduct(int firstId, int endId, float q, float *acc) const {
+
+    endId = min(endId, _idRange);
+    const unsigned char *pValues = _data.empty() ? NULL : &_data[0];
+    int i = firstId;
+
+    // q * (value * _scale), with the scale folded into q
+    float qScaled = q * _scale;
+
+#ifdef POSTINGS_SSE2
+
+    __m128i zero = _mm_setzero_si128();
+    __m128 vq = _mm_set1_ps(qScaled);
+
+    for (; i + 8 <= endId; i += 8) {
+
+        __m128i v = _mm_loadu_si128((const __m128i *) (pValues + 2 * i));
+        __m128 lo = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)), vq);
+        __m128 hi = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)), vq);
+
+        float *pAcc = acc + (i - firstId);
+        _mm_storeu_ps(pAcc, _mm_add_ps(_mm_loadu_ps(pAcc), lo));
+        _mm_storeu_ps(pAcc + 4, _mm_add_ps(_mm_loadu_ps(pAcc + 4), hi));
+
+    }
+
+#endif
+
+    for (; i < endId; i++) {
+        unsigned short value;
+        memcpy(&value, pValues + 2 * i, 2);
+        acc[i - firstId] += qScaled * value;
+    }
+
+}
+
+
+void
+PostingList::decodeDense(int firstId, int endId, float *values) const {
+
+    int lastId = max(firstId, min(endId, _idRange));
+    const unsigned char *pValues = _data.empty() ? NULL : &_data[0];
+    int i = firstId;
+
+#ifdef POSTINGS_SSE2
+
+    __m128i zero = _mm_setzero_si128();
+    __m128 scale = _mm_set1_ps(_scale);
+
+    for (; i + 8 <= lastId; i += 8) {
+
+        __m128i v = _mm_loadu_si128((const __m128i *) (pValues + 2 * i));
+        float *pOut = values + (i - firstId);
+        _mm_storeu_ps(pOut, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)), scale));
+        _mm_storeu_ps(pOut + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)), scale));
+
+    }
+
+#endif
+
+    for (; i < lastId; i++) {
+        unsigned short value;
+        memcpy(&value, pValues + 2 * i, 2);
+        values[i - firstId] = value * _scale;
+    }
+
+    // images added after the list was encoded are absent
+    for (; i < endId; i++) {
+        values[i - firstId] = 0;
+    }
+
+}
+
+
+int
+PostingList::size() const {
+    return _size;
+}
+
+
+int
+PostingList::blocks() const {
+    return _blocks.size();
+}
+
+
+int
+PostingList::blockFirstId(int block) const {
+    return _blocks[block].firstId;
+}
+
+
+float
+PostingList::blockMax(int block) const {
+    return _blocks[block].maxValue * _scale;
+}
+
+
+float
+PostingList::maxValue() const {
+    return _maxValue * _scale;
+}
+
+
+void
+PostingList::swap(PostingList &other) {
+    std::swap(_size, other._size);
+    std::swap(_scale, other._scale);
+    std::swap(_maxValue, other._maxValue);
+    std::swap(_dense, other._dense);
+    std::swap(_idRange, other._idRange);
+    _blocks.swap(other._blocks);
+    _data.swap(other._data);
+}
+
+
+size_t
+PostingList::memory() const {
+    return sizeof(PostingList)
+           + _blocks.capacity() * sizeof(BlockHeader)
+           + _data.capacity();
+}
+
+
+bool
+PostingList::write(FILE *pFile) const {
+
+    int nBlocks = _blocks.size();
+    int dataSize = _data.size();
+
+    bool ok = true;
+    ok = ok && fwrite(&_size, sizeof(_size), 1, pFile) == 1;
+    ok = ok && fwrite(&_scale, sizeof(_scale), 1, pFile) == 1;
+    ok = ok && fwrite(&_maxValue, sizeof(_maxValue), 1, pFile) == 1;
+    ok = ok && fwrite(&_idRange, sizeof(_idRange), 1, pFile) == 1;
+    ok = ok && fwrite(&nBlocks, sizeof(nBlocks), 1, pFile) == 1;
+    ok = ok && fwrite(&dataSize, sizeof(dataSize), 1, pFile) == 1;
+    if (nBlocks > 0) {
+        ok = ok && fwrite(&_blocks[0], sizeof(BlockHeader), nBlocks, pFile) == (size_t) nBlocks;
+        ok = ok && fwrite(&_data[0], 1, dataSize, pFile) == (size_t) dataSize;
+    }
+    return ok;
+
+}
+
+
+bool
+PostingList::read(FILE *pFile) {
+
+    int nBlocks = 0;
+    int dataSize = 0;
+
+    bool ok = true;
+    ok = ok && fread(&_size, sizeof(_size), 1, pFile) == 1;
+    ok = ok && fread(&_scale, sizeof(_scale), 1, pFile) == 1;
+    ok = ok && fread(&_maxValue, sizeof(_maxValue), 1, pFile) == 1;
+    ok = ok && fread(&_idRange, sizeof(_idRange), 1, pFile) == 1;
+    ok = ok && fread(&nBlocks, sizeof(nBlocks), 1, pFile) == 1;
+    ok = ok && fread(&dataSize, sizeof(dataSize), 1, pFile) == 1;
+    if (!ok || nBlocks < 0 || dataSize < 0) {
+        return false;
+    }
+    // dense lists are the ones with an ids range
+    _dense = (_idRange > 0);
+
+    return readBlocks(pFile, nBlocks, dataSize);
+
+}
+
+
+bool
+PostingList::readSparse(FILE *pFile) {
+
+    int nBlocks = 0;
+    int dataSize = 0;
+
+    // the header has no ids range, the blocks are the same as the sparse layout ones
+    bool ok = true;
+    ok = ok && fread(&_size, sizeof(_size), 1, pFile) == 1;
+    ok = ok && fread(&_scale, sizeof(_scale), 1, pFile) == 1;
+    ok = ok && fread(&_maxValue, sizeof(_maxValue), 1, pFile) == 1;
+    ok = ok && fread(&nBlocks, sizeof(nBlocks), 1, pFile) == 1;
+    ok = ok && fread(&dataSize, sizeof(dataSize), 1, pFile) == 1;
+    if (!ok || nBlocks < 0 || dataSize < 0) {
+        return false;
+    }
+    _idRange = 0;
+    _dense = false;
+
+    return readBlocks(pFile, nBlocks, dataSize);
+
+}
+
+
+bool
+PostingList::readBlocks(FILE *pFile, int nBlocks, int dataSize) {
+
+    bool ok = true;
+    _blocks.resize(nBlocks);
+    _data.resize(dataSize);
+    if (nBlocks > 0) {
+        ok = ok && fread(&_blocks[0], sizeof(BlockHeader), nBlocks, pFile) == (size_t) nBlocks;
+        ok = ok && fread(&_data[0], 1, dataSize, pFile) == (size_t) dataSize;
+    }
+    return ok;
+
+}
@@ -0,0 +1,223 @@
+//Copyright (C) 2016, Esteban Uriza <estebanuri@gmail.com>
+//This program is free software: you can use, modify and/or
+//redistribute it under the terms of the GNU General Public
+//License as published by the Free Software Foundation, either
+//version 3 of the License, or (at your option) any later
+//version. You should have received a copy of this license along
+//this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef POSTINGLIST_H_
+#define POSTINGLIST_H_
+
+#include <stdio.h>
+#include <vector>
+
+using namespace std;
+
+
+/**
+ * A component of a d-vector: the value of the node for an image
+ */
+struct Posting {
+    int idFile;
+    float value;
+};
+
+
+class PostingList {
+
+public:
+
+    /**
+     * PostingList class stores the d-vector components of a node in a compressed form.
+     * Postings (sorted by image id) are grouped in blocks of BLOCK postings.
+     * In each block, image ids are stored as deltas with a fixed byte width (1, 2 or 4 bytes,
+     * the smallest one that fits all the deltas of the block), and values are quantized to 16 bits
+     * using a scale shared by all the node. Each block header keeps its first image id
+     * (so that lists can be seeked by image id) and its maximum value.
+     * Blocks are decoded with SSE2 when available.
+     *
+     * Lists of nodes with postings for a large fraction of the images use a dense layout instead:
+     * a 16 bits value per image id (0 for absent images), split in blocks of BLOCK ids.
+     * Dense lists are scored with a contiguous pass (see addMin), with no ids to decode.
+     *
+     * Positions in a list (cursors) are encoded as block * BLOCK + position in the decoded block,
+     * and end() is the position after the last block.
+     */
+
+    // number of postings of a block (all the blocks but the last one are full)
+    static const int BLOCK = 128;
+
+    /**
+     * PostingList constructor (creates an empty list)
+     */
+    PostingList();
+
+    /**
+     * Compresses the given postings into this list.
+     * The dense layout is used when it does not take more memory than the sparse one.
+     * @param postings postings sorted by image id
+     * @param idRange number of image ids (all the ids are lower), used by the dense layout
+     */
+    void encode(const vector<Posting> &postings, int idRange);
+
+    /**
+     * Decompresses all the postings of this list
+     * @param postings output postings
+     */
+    void decode(vector<Posting> &postings) const;
+
+    /**
+     * Decompresses a block of postings
+     * @param block block to be decoded
+     * @param ids output image ids (room for BLOCK elements)
+     * @param values output values (room for BLOCK elements)
+     * @return the number of postings of the block
+     */
+    int decodeBlock(int block, int *ids, float *values) const;
+
+    /**
+     * Looks for the first posting with an image id not lower than idFile
+     * @param idFile image id
+     * @return the position of that posting, or end() if there is none
+     */
+    int seek(int idFile) const;
+
+    /**
+     * @return the position after the last block
+     */
+    int end() const;
+
+    /**
+     * @return true if the list uses the dense layout
+     */
+    bool isDense() const;
+
+    /**
+     * For dense lists, accumulates min(q, value) for a range of image ids
+     * @param firstId first image id of the range
+     * @param endId image id after the last one of the range
+     * @param q value compared to the postings values
+     * @param acc accumulators, acc[i] corresponds to the image id firstId + i
+     */
+    void addMin(int firstId, int endId, float q, float *acc) const;
+
+    /**
+     * For dense lists, accumulates q * value for a range of image ids
+     * @param firstId first image id of the range
+     * @param endId image id after the last one of the range
+     * @param q value multiplied by the postings values
+     * @param acc accumulators, acc[i] corresponds to the image id firstId + i
+     */
+    void addProduct(int firstId, int endId, float q, float *acc) const;
+
+    /**
+     * For dense lists, decodes the values of a range of image ids (0 for the absent images)
+     * @param firstId first image id of the range
+     * @param endId image id after the last one of the range
+     * @param values output values, values[i] corresponds to the image id firstId + i
+     */
+    void decodeDense(int firstId, int endId, float *values) const;
+
+    /**
+     * @return the number of postings
+     */
+    int size() const;
+
+    /**
+     * @return the number of blocks
+     */
+    int blocks() const;
+
+    /**
+     * @param block block index
+     * @return the image id of the first posting of the block
+     */
+    int blockFirstId(int block) const;
+
+    /**
+     * @param block block index
+     * @return the maximum (decoded) value of the postings of the block
+     */
+    float blockMax(int block) const;
+
+    /**
+     * @return the maximum (decoded) value of the postings of the list
+     */
+    float maxValue() const;
+
+    /**
+     * Exchanges the content of this list with another one (without copying the data)
+     * @param other the other list
+     */
+    void swap(PostingList &other);
+
+    /**
+     * @return the number of bytes used by the list
+     */
+    size_t memory() const;
+
+    /**
+     * Writes the list to a binary file
+     * @param pFile output file
+     * @return true if it was written
+     */
+    bool write(FILE *pFile) const;
+
+    /**
+     * Reads the list from a binary file
+     * @param pFile input file
+     * @return true if it was read
+     */
+    bool read(FILE *pFile);
+
+    /**
+     * Reads a list written before the dense layout existed (d-vectors format 1).
+     * The list is read with the sparse layout.
+     * @param pFile input file
+     * @return true if it was read
+     */
+    bool readSparse(FILE *pFile);
+
+private:
+
+    /**
+     * Reads the blocks of the list, once its header has been read
+     * @param pFile input file
+     * @param nBlocks number of blocks
+     * @param dataSize size of the encoded data
+     * @return true if it was read
+     */
+    bool readBlocks(FILE *pFile, int nBlocks, int dataSize);
+
+    struct BlockHeader {
+        int firstId;
+        unsigned int offset;
+        unsigned short maxValue;
+        // 0 for the dense layout
+        unsigned char width;
+        unsigned char count;
+    };
+
+    // number of postings
+    int _size;
+
+    // values are stored as round(value / _scale)
+    float _scale;
+
+    // maximum quantized value of the list
+    unsigned short _maxValue;
+
+    // dense layout, with a value for each one of the _idRange image ids
+    bool _dense;
+    int _idRange;
+
+    vector<BlockHeader> _blocks;
+
+    // blocks data: for each block, count id deltas of width bytes each (the first delta is 0)
+    // followed by count 16 bits values. For the dense layout, the 16 bits value of each image id.
+    vector<unsigned char> _data;
+
+};
+
+#endif /* POSTINGLIST_H_ */
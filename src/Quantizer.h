@@ -0,0 +1,67 @@
+// Copyright (C) 2016, Esteban Uriza <estebanuri@gmail.com>
+// This program is free software: you can use, modify and/or
+// redistribute it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later
+// version. You should have received a copy of this license along
+// this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef QUANTIZER_H_
+#define QUANTIZER_H_
+
+#include <cv.h>
+#include <string>
+
+using namespace cv;
+using namespace std;
+
+
+class Quantizer {
+
+public:
+
+    /**
+     * Quantizer class maps descriptors to visual words. Words are the leaves of the vocabulary tree,
+     * identified by their leaf index: the inverted index and the scoring only depend on the words,
+     * so the descent of the tree can be replaced by another search over the same words.
+     * Implementations must allow concurrent calls on disjoint ranges of descriptors, each one
+     * with its own scratch.
+     */
+
+    /**
+     * Scratch memory of the searches of a worker. It is created by the quantizer, kept by the caller
+     * (see VocTree::QueryContext) and reused by the next calls of that worker, so that steady state
+     * searches do not allocate memory.
+     */
+    class Scratch {
+    public:
+        virtual ~Scratch() {
+        }
+    };
+
+    virtual ~Quantizer() {
+    }
+
+    /**
+     * @return a new scratch for this quantizer
+     */
+    virtual Ptr<Scratch> createScratch() = 0;
+
+    /**
+     * Finds the word of a range of descriptors
+     * @param descriptors descriptors (one per row)
+     * @param rowStart first descriptor of the range
+     * @param rowEnd last descriptor of the range (not included)
+     * @param words output words, words[r] is the leaf index of the descriptor r
+     * @param scratch scratch created by this quantizer (see createScratch), not shared with other calls
+     */
+    virtual void quantize(Mat &descriptors, int rowStart, int rowEnd, int *words, Scratch &scratch) = 0;
+
+    /**
+     * @return a short name of the quantizer (used by the reports)
+     */
+    virtual string name() = 0;
+
+};
+
+#endif /* QUANTIZER_H_ */
@@ -182,6 +182,63 @@ void handleQuery(string query, int sockfd, Ptr<Database> &db) {
 }
 
 
+void handleStream(string video, int sockfd, Ptr<Database> &db) {
+
+    string msg;
+    msg = "executing stream: " + video;
+    sendMessage(sockfd, msg);
+
+    string fileVideo;
+    if (startsWith(video, "...")) {
+        video = dropPrefix(video, "...");
+        fileVideo += db->getPath();
+    }
+    fileVideo += video;
+
+    VideoCapture vc(fileVideo.c_str());
+    if (!vc.isOpened()) {
+        sendMessage(sockfd, "cannot open video " + fileVideo);
+        return;
+    }
+
+    int limit = 16;
+
+    if (!db->isStreamIncremental()) {
+        sendMessage(sockfd, "warning: the L1 scoring norm scores every frame from scratch "
+                "(build the database with -scoring L2 or HELLINGER for incremental scoring)");
+    }
+
+    // consecutive frames share most of their words, the session scores only the changes
+    VocTree::StreamSession session;
+    vector<Matching> result;
+    Mat frame;
+    for (int frameNumber = 0; vc.read(frame); frameNumber++) {
+
+        db->queryFrame(frame, session, result, limit);
+
+        for (unsigned int i = 0; i < result.size(); i++) {
+
+            Matching m = result.at(i);
+            DBElem info = db->getFileInfo(m.id);
+
+            stringstream ss;
+            ss << frameNumber << "," << m.score << "," << m.id << ", " << info.name << endl;
+
+            int n = write(sockfd, ss.str().c_str(), ss.str().size());
+            if (n < 0) {
+                cerr << "writing response: error writing to socket" << endl;
+                exit(1);
+            }
+
+        }
+
+    }
+
+    cout << "stream done." << endl;
+
+}
+
+
 void handleCommand(string command, int sockfd, Ptr<Database> &db) {
 
     //bool breaks = false;
@@ -197,6 +254,9 @@ void handleCommand(string command, int sockfd, Ptr<Database> &db) {
     } else if (startsWith(command, "query ")) {
         string query = dropPrefix(command, "query ");
         handleQuery(query, sockfd, db);
+    } else if (startsWith(command, "stream ")) {
+        string video = dropPrefix(command, "stream ");
+        handleStream(video, sockfd, db);
     } else {
         string msg = "unknown command '" + command + "'.";
         sendMessage(sockfd, msg);
@@ -405,6 +465,41 @@ void startDatabase(string dbPath) {
     db = Database::load(dbPath);
     cout << "load done." << endl << flush;
 
+    // optional beam descent for the queries (see VocTree::setBeam)
+    Configuration cfg = readConfig(dbPath);
+    if (cfg.has("beam")) {
+        int width = atoi(cfg.get("beam").c_str());
+        float ratio = cfg.has("beamRatio") ? (float) atof(cfg.get("beamRatio").c_str()) : 0;
+        db->setBeam(width, ratio);
+    }
+    if (cfg.has("budgetDescriptors") || cfg.has("budgetMillis")) {
+        int maxDescriptors = cfg.has("budgetDescriptors") ? atoi(cfg.get("budgetDescriptors").c_str()) : 0;
+        double maxMillis = cfg.has("budgetMillis") ? atof(cfg.get("budgetMillis").c_str()) : 0;
+        db->setQueryBudget(maxDescriptors, maxMillis);
+    }
+    if (cfg.has("cascadeLevel")) {
+        int level = atoi(cfg.get("cascadeLevel").c_str());
+        int candidates = cfg.has("cascadeCandidates") ? atoi(cfg.get("cascadeCandidates").c_str()) : 1000;
+        db->setCascade(level, candidates);
+    }
+    if (cfg.has("quantizedCenters")) {
+        db->useQuantizedCenters(atoi(cfg.get("quantizedCenters").c_str()) != 0);
+    }
+    // the quantizer of the database can be replaced for the queries
+    if (cfg.has("quantizer") && cfg.get("quantizer") == "hnsw") {
+        int M = cfg.has("hnswM") ? atoi(cfg.get("hnswM").c_str()) : 16;
+        int efConstruction = cfg.has("hnswEfConstruction") ? atoi(cfg.get("hnswEfConstruction").c_str()) : 200;
+        int ef = cfg.has("hnswEf") ? atoi(cfg.get("hnswEf").c_str()) : 64;
+        db->useHnsw(M, efConstruction, ef);
+    } else if (cfg.has("quantizer") && cfg.get("quantizer") == "tree") {
+        db->useHnsw(0, 0, 0);
+    }
+
+    // each connection is served by a forked process, which starts from a copy of this one:
+    // the query scratch is allocated here once, so that the children do not allocate it on every query
+    // (they share the pages until they write them, the reuse does not cross processes)
+    db->warmQueryContext(16);
+
     delStartingLock(dbPath);
 
 
@@ -458,6 +553,32 @@ void runQuery(string dbPath, string query) {
 }
 
 
+void runStream(string dbPath, string video) {
+
+    int port = getPort(dbPath);
+
+    string host = "localhost";
+    string command = "stream " + video;
+    try {
+
+        string ret = sendCommand(host, port, command);
+        cout << ret << endl;
+
+    }
+    catch (int ex) {
+
+        // can't run command.
+        if (isStarting(dbPath)) {
+            cout << "database is STARTING" << endl;
+        } else {
+            cout << "database is STOPPED" << endl;
+        }
+
+    }
+
+}
+
+
 void stopDatabase(string dbPath) {
 
     int port = getPort(dbPath);
@@ -60,6 +60,8 @@ string readCommand(int newsockfd);
 
 void handleQuery(string query, int sockfd, Ptr<Database> &db);
 
+void handleStream(string video, int sockfd, Ptr<Database> &db);
+
 void handleCommand(string command, int sockfd, Ptr<Database> &db);
 
 void processClient(int sockfd, Ptr<Database> &db);
@@ -80,5 +82,7 @@ void delStartingLock(string dbPath);
 
 void runQuery(string dbPath, string query);
 
+void runStream(string dbPath, string video);
+
 
 #endif /* SERVER_H_ */
@@ -11,20 +11,439 @@
 
 #include <set>
 #include <limits>
+#include <climits>
+#include <algorithm>
+#include <cstring>
 
 #include "MatPersistor.h"
 #include "VecPersistor.hpp"
 #include "ExtKmeans.h"
 #include "FileHelper.h"
 #include "KMeans.h"
+#include "Distance.h"
+#include "PostingList.h"
+#include "HnswQuantizer.h"
 
 using namespace cv;
 using namespace std;
 
+// cache line size, used to align the centers
+static const size_t CACHE_LINE = 64;
+
+// minimum number of descriptors sharing a node to use the matrix multiplication on the batched descent
+// (smaller groups are faster with the per descriptor kernels). Levels with a specialized closest child
+// kernel always use it (see descend)
+static const int GEMM_MIN_ROWS = 16;
+
+// maximum number of children compared by a single matrix multiplication of the batched descent.
+// Wider nodes (a flat vocabulary) are compared in blocks, so the products take at most
+// rows x GEMM_MAX_CHILDREN floats
+static const int GEMM_MAX_CHILDREN = 512;
+
+// minimum number of descriptors per quantization chunk: queries with fewer descriptors
+// than twice this value are quantized by a single thread
+static const int QUANTIZE_MIN_ROWS = 256;
+
+// size of the smallest chunk of a deadline bounded query: the first chunk, which is quantized even
+// when the deadline has already passed, and the chunks quantized when little time is left.
+// It does not depend on the number of threads, so it bounds how far a query can go past its deadline
+static const int ANYTIME_MIN_ROWS = 32;
+
+// number of images of a scores block. Scores and stamps of a block (64 KB) stay in the L2 cache
+// while all the posting lists of the query are applied to it
+static const int SCORE_BLOCK = 8192;
+
+// tolerance used when image blocks are pruned, covers the rounding of the score updates
+static const float PRUNE_EPS = 1e-5f;
+
+// format of the d-vectors file:
+// 0: raw components (image id and value) per node
+// 1: compressed posting lists (see PostingList)
+// 2: compressed posting lists, with the dense layout for high frequency nodes
+static const int VECTORS_FORMAT = 2;
+
+// number of queries scored together by queryBatch. Each one needs its own scores array
+static const int QUERY_BATCH = 8;
+
+// number of scoring stripes per thread (a few per thread help balancing the load)
+static const int STRIPES_PER_THREAD = 4;
+
+// added to the distances when the beam votes are computed, so that exact matches get all the vote
+static const float BEAM_EPS = 1e-6f;
+
+// a streaming session scores a frame from scratch after this number of incremental frames,
+// so that the rounding errors of the dot product updates do not accumulate
+static const int STREAM_REFRESH_FRAMES = 64;
+
+// a streaming session keeps the images whose dot product is above this fraction of the query norm.
+// The dot products are updated frame after frame, so an image that no longer shares a node with the
+// query is left with the rounding errors instead of an exact 0 (its score would be 2 anyway)
+static const float STREAM_DOT_EPS = 1e-5f;
+
+
+// accumulation policies of the scoring: with normalized vectors, the score of an image
+// is 2 - 2 * sum(term(qi, di)) over the nodes where both q and d are not null
+
+// L1 distance: |q - d| = q + d - 2 * min(q, d)
+struct MinScoring {
+
+    static inline float term(float q, float d) {
+        return min(q, d);
+    }
+
+    static inline void addDense(const PostingList &comps, int firstId, int endId, float q, float *acc) {
+        comps.addMin(firstId, endId, q, acc);
+    }
+
+    static inline void addValues(const float *values, int n, float q, float *acc) {
+        for (int i = 0; i < n; i++) {
+            acc[i] += min(q, values[i]);
+        }
+    }
+
+};
+
+// squared L2 distance: (q - d)^2 = q^2 + d^2 - 2 * q * d
+struct DotScoring {
+
+    static inline float term(float q, float d) {
+        return q * d;
+    }
+
+    static inline void addDense(const PostingList &comps, int firstId, int endId, float q, float *acc) {
+        comps.addProduct(firstId, endId, q, acc);
+    }
+
+    static inline void addValues(const float *values, int n, float q, float *acc) {
+        for (int i = 0; i < n; i++) {
+            acc[i] += q * values[i];
+        }
+    }
+
+};
+
+
+class VocTree::DescentBody : public ParallelLoopBody {
+
+public:
+
+    DescentBody(VocTree *vt, Mat *descriptors, QueryContext *ctx, int nChunks) :
+            _vt(vt), _descriptors(descriptors), _ctx(ctx), _nChunks(nChunks) {
+    }
+
+    void operator()(const Range &range) const {
+        // each chunk writes the paths of its own descriptors, using its own scratch
+        int rows = _descriptors->rows;
+        for (int c = range.start; c < range.end; c++) {
+            int rowStart = (int) ((long) c * rows / _nChunks);
+            int rowEnd = (int) ((long) (c + 1) * rows / _nChunks);
+            if (_ctx->soft) {
+                _vt->descendBeam(*_descriptors, rowStart, rowEnd, _ctx->descent[c], *_ctx);
+            } else {
+                _vt->descend(*_descriptors, rowStart, rowEnd, _ctx->descent[c], _ctx->paths);
+            }
+        }
+    }
+
+private:
+
+    VocTree *_vt;
+    Mat *_descriptors;
+    QueryContext *_ctx;
+    int _nChunks;
+
+};
+
+
+// parallel body used to find the words of chunks of descriptors with a quantizer
+class QuantizeBody : public ParallelLoopBody {
+
+public:
+
+    QuantizeBody(Quantizer *quantizer, Mat *descriptors, int *words, vector<Ptr<Quantizer::Scratch> > *scratch,
+                 int nChunks) :
+            _quantizer(quantizer), _descriptors(descriptors), _words(words), _scratch(scratch), _nChunks(nChunks) {
+    }
+
+    void operator()(const Range &range) const {
+        // each chunk uses its own scratch
+        int rows = _descriptors->rows;
+        for (int c = range.start; c < range.end; c++) {
+            int rowStart = (int) ((long) c * rows / _nChunks);
+            int rowEnd = (int) ((long) (c + 1) * rows / _nChunks);
+            _quantizer->quantize(*_descriptors, rowStart, rowEnd, _words, *(*_scratch)[c]);
+        }
+    }
+
+private:
+
+    Quantizer *_quantizer;
+    Mat *_descriptors;
+    int *_words;
+    vector<Ptr<Quantizer::Scratch> > *_scratch;
+    int _nChunks;
+
+};
+
+
+// finds the words of the descriptors with the given quantizer (large queries are quantized in parallel).
+// The scratch of each chunk is kept in scratch, and it is only created when owner is another quantizer
+// (owner keeps the quantizer alive, so another one cannot take its address)
+static void quantizeWords(Ptr<Quantizer> quantizer, Mat &descriptors, vector<int> &words,
+                          vector<Ptr<Quantizer::Scratch> > &scratch, Ptr<Quantizer> &owner) {
+
+    int rows = descriptors.rows;
+    words.resize(rows);
+    if (rows == 0) {
+        return;
+    }
+
+    int nChunks = max(1, min(getNumThreads(), rows / QUANTIZE_MIN_ROWS));
+    if (owner.get() != quantizer.get()) {
+        scratch.clear();
+        owner = quantizer;
+    }
+    while ((int) scratch.size() < nChunks) {
+        scratch.push_back(quantizer->createScratch());
+    }
+
+    QuantizeBody body(quantizer.get(), &descriptors, &words[0], &scratch, nChunks);
+    if (nChunks == 1) {
+        body(Range(0, 1));
+    } else {
+        parallel_for_(Range(0, nChunks), body);
+    }
+
+}
+
+
+// the batched greedy descent, as a quantizer
+class VocTree::TreeQuantizer : public Quantizer {
+
+public:
+
+    TreeQuantizer(VocTree *vt) : _vt(vt) {
+    }
+
+    // the descent scratch and the paths of a worker
+    class TreeScratch : public Scratch {
+    public:
+        QueryContext::DescentScratch descent;
+        vector<int> paths;
+    };
+
+    Ptr<Scratch> createScratch() {
+        return Ptr<Scratch>(new TreeScratch());
+    }
+
+    void quantize(Mat &descriptors, int rowStart, int rowEnd, int *words, Scratch &scratch) {
+
+        TreeScratch &tree = static_cast<TreeScratch &>(scratch);
+        int stride = _vt->_h + 1;
+        Mat range = descriptors.rowRange(rowStart, rowEnd);
+        vector<int> &paths = tree.paths;
+        paths.assign(range.rows * stride, -1);
+        _vt->descend(range, 0, range.rows, tree.descent, paths);
+
+        for (int r = 0; r < range.rows; r++) {
+            int level = stride - 1;
+            while (paths[r * stride + level] < 0) {
+                level--;
+            }
+            words[rowStart + r] = _vt->_indexLeaves[paths[r * stride + level]];
+        }
+
+    }
+
+    string name() {
+        return "tree";
+    }
+
+private:
+
+    VocTree *_vt;
+
+};
+
+
+// compares each descriptor with all the leaves (the closest leaf, used as ground truth)
+class VocTree::ExactQuantizer : public Quantizer {
+
+public:
+
+    ExactQuantizer(VocTree *vt) : _vt(vt) {
+    }
+
+    Ptr<Scratch> createScratch() {
+        return Ptr<Scratch>(new Scratch());
+    }
+
+    void quantize(Mat &descriptors, int rowStart, int rowEnd, int *words, Scratch &) {
+
+        const vector<int> &leafNodes = _vt->_leafNodes;
+        for (int r = rowStart; r < rowEnd; r++) {
+
+            const uchar *q = descriptors.ptr(r);
+            int best = -1;
+            float minDist = numeric_limits<float>::max();
+            for (unsigned int idxLeaf = 0; idxLeaf < leafNodes.size(); idxLeaf++) {
+                const uchar *c = _vt->_centers.ptr(leafNodes[idxLeaf]);
+                float d = (_vt->_l2Sqr != NULL)
+                          ? _vt->_l2Sqr((const float *) q, (const float *) c, _vt->_centDim)
+                          : (float) _vt->_hamming(q, c, _vt->_centDim);
+                if (d < minDist) {
+                    minDist = d;
+                    best = idxLeaf;
+                }
+            }
+            words[r] = best;
+
+        }
+
+    }
+
+    string name() {
+        return "exact";
+    }
+
+private:
+
+    VocTree *_vt;
+
+};
+
+
+class VocTree::BatchScoringBody : public ParallelLoopBody {
+
+public:
+
+    BatchScoringBody(VocTree *vt, int count, int nStripes, int nBlocks) :
+            _vt(vt), _count(count), _nStripes(nStripes), _nBlocks(nBlocks) {
+    }
+
+    void operator()(const Range &range) const {
+        for (int s = range.start; s < range.end; s++) {
+            _vt->scoreBatchStripe(_count, s, _nStripes, _nBlocks);
+        }
+    }
+
+private:
+
+    VocTree *_vt;
+    int _count;
+    int _nStripes;
+    int _nBlocks;
+
+};
+
+
+class VocTree::ScoringBody : public ParallelLoopBody {
+
+public:
+
+    ScoringBody(VocTree *vt, QueryContext *ctx, int nStripes, int nBlocks) :
+            _vt(vt), _ctx(ctx), _nStripes(nStripes), _nBlocks(nBlocks) {
+    }
+
+    void operator()(const Range &range) const {
+        for (int s = range.start; s < range.end; s++) {
+            _vt->scoreStripe(*_ctx, s, _nStripes, _nBlocks);
+        }
+    }
+
+private:
+
+    VocTree *_vt;
+    QueryContext *_ctx;
+    int _nStripes;
+    int _nBlocks;
+
+};
+
+
+int
+VocTree::getScoringType(string name) {
+
+    if (strcasecmp(name.c_str(), "L1") == 0) {
+        return SCORING_L1;
+    }
+    if (strcasecmp(name.c_str(), "L2") == 0) {
+        return SCORING_L2;
+    }
+    if (strcasecmp(name.c_str(), "HELLINGER") == 0) {
+        return SCORING_HELLINGER;
+    }
+    return -1;
+
+}
+
+
+string
+VocTree::getScoringName(int scoring) {
+
+    if (scoring == SCORING_L2) {
+        return "L2";
+    }
+    if (scoring == SCORING_HELLINGER) {
+        return "HELLINGER";
+    }
+    return "L1";
+
+}
+
+
+bool
+VocTree::parseQuantizer(string spec, int &M, int &efConstruction, int &ef) {
+
+    M = 0;
+    efConstruction = 0;
+    ef = 0;
+    if (strcasecmp(spec.c_str(), "tree") == 0) {
+        return true;
+    }
+
+    // hnsw, followed by the optional parameters separated by ':'
+    vector<string> parts;
+    string rest = spec + ":";
+    for (int start = 0, end; (end = rest.find(":", start)) != -1; start = end + 1) {
+        parts.push_back(rest.substr(start, end - start));
+    }
+    if (strcasecmp(parts[0].c_str(), "hnsw") != 0 || parts.size() > 4) {
+        return false;
+    }
+
+    M = parts.size() > 1 ? atoi(parts[1].c_str()) : 16;
+    efConstruction = parts.size() > 2 ? atoi(parts[2].c_str()) : 200;
+    ef = parts.size() > 3 ? atoi(parts[3].c_str()) : 64;
+    return M > 0 && efConstruction > 0 && ef > 0;
+
+}
+
 
 bool VocTree::isLeaf(int idNode) {
-    int idxNode = _index[idNode];
-    return (_indexLeaves.at(idxNode) != -1);
+    return (_firstChild[idNode] == -1);
+}
+
+
+int VocTree::childCount(int idNode) {
+    return _levelK[_nodeLevels[idNode]];
+}
+
+
+void
+VocTree::setLevelK(const vector<int> &levelK) {
+
+    // the last branch factor given is used for the deeper levels
+    // (with no branch factors, _k is used for all the levels)
+    _levelK.assign(_h, _k);
+    if (!levelK.empty()) {
+        _k = 0;
+        for (int level = 0; level < _h; level++) {
+            _levelK[level] = levelK[min(level, (int) levelK.size() - 1)];
+            _k = max(_k, _levelK[level]);
+        }
+    }
+
 }
 
 
@@ -127,35 +546,254 @@ VocTree::getNextIdxLeaf() {
 }
 
 
+int
+VocTree::newNode(const Mat &center) {
+
+    int idNode = getNextIdxNode();
+
+    Mat row;
+    center.convertTo(row, _centType);
+    _centers.push_back(row);
+    _firstChild.push_back(-1);
+    _indexLeaves.push_back(-1);
+
+    return idNode;
+
+}
+
+
+void
+VocTree::alignCenters(Mat &centers) {
+
+    // rows are padded to a multiple of the cache line size (or to a power of two
+    // for short binary descriptors), and the buffer starts on a cache line,
+    // so a block of sibling centers is scanned touching the minimum number of lines.
+    size_t rowBytes = centers.cols * centers.elemSize();
+    size_t step;
+    if (rowBytes < CACHE_LINE) {
+        step = 1;
+        while (step < rowBytes) {
+            step *= 2;
+        }
+    } else {
+        step = (rowBytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    }
+
+    Mat buffer(1, (int) (step * centers.rows + CACHE_LINE), CV_8U);
+    uchar *pAligned = alignPtr(buffer.data, CACHE_LINE);
+
+    Mat aligned(centers.rows, centers.cols, centers.type(), pAligned, step);
+    centers.copyTo(aligned);
+
+    // buffer owns the memory, _centers is a (padded) view over it
+    _centersBuffer = buffer;
+    _centers = aligned;
+
+}
+
+
+void
+VocTree::reorderNodes(vector<int> &order, vector<int> &firstChild) {
+
+    int nodes = order.size();
+
+    vector<int> leaves(nodes);
+    Mat centers(nodes, _centDim, _centType);
+    for (int n = 0; n < nodes; n++) {
+        leaves[n] = _indexLeaves[order[n]];
+        _centers.row(order[n]).copyTo(centers.row(n));
+    }
+
+    _firstChild = firstChild;
+    _indexLeaves = leaves;
+    _usedNodes = nodes;
+    alignCenters(centers);
+    computeNodeLevels();
+
+}
+
+
 void
-VocTree::expand(Mat &mat, int rows) {
-    if (mat.rows < rows) {
-        mat.resize(rows);
+VocTree::computeNodeLevels() {
+
+    // children have greater ids than their parent, so a forward scan sets the parents first
+    _nodeLevels.assign(_usedNodes, 0);
+    for (int idNode = 0; idNode < _usedNodes; idNode++) {
+        if (!isLeaf(idNode)) {
+            int k = _levelK[_nodeLevels[idNode]];
+            for (int i = 0; i < k; i++) {
+                _nodeLevels[_firstChild[idNode] + i] = _nodeLevels[idNode] + 1;
+            }
+        }
+    }
+
+}
+
+
+bool
+VocTree::compactNodes() {
+
+    // a node is live if some image has a descriptor going through it.
+    // Children have greater ids than their parent, so a reverse scan sees them first
+    vector<unsigned char> live(_usedNodes, 0);
+    for (int idNode = _usedNodes - 1; idNode >= 0; idNode--) {
+        if (isLeaf(idNode)) {
+            live[idNode] = !_invIdx.at(_indexLeaves[idNode]).empty();
+        } else {
+            for (int i = 0; i < childCount(idNode); i++) {
+                live[idNode] |= live[_firstChild[idNode] + i];
+            }
+        }
+    }
+
+    // breadth first traversal expanding only the live nodes
+    vector<int> order;      // new id -> current id
+    vector<int> firstChild; // first child using the new ids
+    order.push_back(0);
+    for (unsigned int n = 0; n < order.size(); n++) {
+        int idNode = order[n];
+        if (isLeaf(idNode) || !live[idNode]) {
+            firstChild.push_back(-1);
+        } else {
+            firstChild.push_back(order.size());
+            for (int i = 0; i < childCount(idNode); i++) {
+                order.push_back(_firstChild[idNode] + i);
+            }
+        }
+    }
+
+    if (!live[0] || (int) order.size() == _usedNodes) {
+        return false;
+    }
+
+    cout << "compacting nodes: " << _usedNodes << " -> " << order.size() << endl;
+
+    // leaves are numbered in the new node order. Removed leaves have no postings,
+    // so no descriptor refers to them
+    vector<int> leafMap(_usedLeaves, -1);
+    vector<int> leaves(order.size(), -1);
+    int nLeaves = 0;
+    for (unsigned int n = 0; n < order.size(); n++) {
+        if (firstChild[n] == -1) {
+            int old = order[n];
+            if (isLeaf(old)) {
+                leafMap[_indexLeaves[old]] = nLeaves;
+            }
+            leaves[n] = nLeaves++;
+        }
+    }
+
+    vector<vector<int> > invIdx(nLeaves);
+    for (int idx = 0; idx < _usedLeaves; idx++) {
+        if (leafMap[idx] != -1) {
+            invIdx[leafMap[idx]].swap(_invIdx[idx]);
+        }
+    }
+    _invIdx.swap(invIdx);
+
+    Mat weights((int) order.size(), 1, CV_32F);
+    vector<PostingList> dVectors(order.size());
+    for (unsigned int n = 0; n < order.size(); n++) {
+        weights.at<float>(n) = _weights.at<float>(order[n]);
+        dVectors[n].swap(_dVectors.at(order[n]));
+    }
+    _weights = weights;
+    _dVectors.swap(dVectors);
+
+    reorderNodes(order, firstChild);
+    _indexLeaves = leaves;
+    _usedLeaves = nLeaves;
+
+    // the leaves map and the quantizer refer to the old leaves
+    _parents.clear();
+    _leafNodes.clear();
+    _quantizer.release();
+    selectKernels();
+
+    // the words file stores leaf indices, it is rewritten with the new ones
+    FileManager fm(_path);
+    string fileWords = fm.file(FileManager::WORDS);
+    string fileCompacted = fileWords + ".tmp";
+    MatPersistor mpWords(fileWords);
+    if (mpWords.exists() && mpWords.openRead()) {
+
+        // create() leaves the file closed
+        MatPersistor mpCompacted(fileCompacted);
+        if (!mpCompacted.create(1, CV_32S) || !mpCompacted.openWrite()) {
+            // the old words are not valid anymore, queries of indexed files use the descriptors
+            cerr << "cannot write " << fileCompacted << ", removing " << fileWords << endl;
+            mpWords.close();
+            remove(fileWords.c_str());
+            return true;
+        }
+
+        Mat buffer(16 * MEGA / sizeof(int), 1, CV_32S);
+        int rowsRead;
+        while ((rowsRead = mpWords.read(buffer, buffer.rows)) > 0) {
+            for (int r = 0; r < rowsRead; r++) {
+                buffer.at<int>(r) = leafMap[buffer.at<int>(r)];
+            }
+            mpCompacted.append(buffer, rowsRead);
+        }
+
+        mpWords.close();
+        mpCompacted.close();
+        if (rename(fileCompacted.c_str(), fileWords.c_str()) != 0) {
+            cerr << "cannot replace " << fileWords << endl;
+        }
+
     }
+
+    return true;
+
 }
 
 
-void shrink(Mat &mat, int rows) {
-    if (mat.rows > rows) {
-        mat.resize(rows);
+void
+VocTree::layoutNodes() {
+
+    // Breadth first traversal: all the children of a node are enqueued together,
+    // so they get consecutive ids in the new numbering, and the upper levels
+    // of the tree (the hottest ones on the descent) are packed at the beginning.
+    vector<int> order;      // new id -> current id
+    vector<int> firstChild; // first child using the new ids
+    vector<int> levels;     // level of each node (the number of children depends on it)
+
+    order.push_back(0);
+    levels.push_back(0);
+    for (unsigned int n = 0; n < order.size(); n++) {
+        int idNode = order[n];
+        if (isLeaf(idNode)) {
+            firstChild.push_back(-1);
+        } else {
+            firstChild.push_back(order.size());
+            for (int i = 0; i < _levelK[levels[n]]; i++) {
+                order.push_back(_firstChild[idNode] + i);
+                levels.push_back(levels[n] + 1);
+            }
+        }
     }
+
+    reorderNodes(order, firstChild);
+
 }
 
 static int lastProgress = -1;
 
-void showProgress(int k, int idNode, int level, int child) {
+// k0 and k1 are the branch factors of the levels 0 and 1 (the children of the root are 1 to k0)
+void showProgress(int k0, int k1, int idNode, int level, int child) {
 
     if (level == 1) {
         if (idNode == 1 && child == 0) {
             std::cout << "progress: ";
         }
 
-        int progress = 100 * (k * idNode + child + 1) / (k * k + k);
+        int progress = 100 * (k1 * (idNode - 1) + child + 1) / (k0 * k1);
         if (lastProgress != progress) {
             std::cout << progress << "% ";
             lastProgress = progress;
         }
-        if (idNode == k && child == (k - 1)) {
+        if (idNode == k0 && child == (k1 - 1)) {
             std::cout << endl;
         }
         std::cout << flush;
@@ -183,21 +821,16 @@ VocTree::buildNodeGen(
     assert(fromFile == (pFileName != NULL));
     assert(!fromFile == (pDescs != NULL));
 
-    int idxNode = getNextIdxNode();
-    _index[idNode] = idxNode;
-
-    if (rows <= _k || level >= _h) {
+    if (level >= _h || rows <= _levelK[level]) {
 
         // it's a leaf
-        //_leaves.at<char>(idxNode) = 1;
         int idxLeaf = getNextIdxLeaf();
-        _indexLeaves[idxNode] = idxLeaf;
+        _indexLeaves[idNode] = idxLeaf;
 
     } else {
 
         // not a leaf
-        _indexLeaves[idxNode] = -1;
-
+        int k = _levelK[level];
         Mat centers;
 
         vector<string> fileClusters;
@@ -208,7 +841,7 @@ VocTree::buildNodeGen(
             // Cluster from file
 
             string fileName = *pFileName;
-            cluster(_k, fileName, centers, fileClusters);
+            cluster(k, fileName, centers, fileClusters);
 
             if (idNode != 0) {
                 // the input file is not longer necessary.
@@ -220,16 +853,24 @@ VocTree::buildNodeGen(
 
             // Cluster from matrix
             //cout << "cluster from matrix" << endl;
-            cluster(_k, *pDescs, centers, matClusters);
+            cluster(k, *pDescs, centers, matClusters);
+
 
+        }
 
+        // the K children are created together before building them,
+        // so that siblings (and their centers) are stored contiguously
+        int firstChild = newNode(centers.row(0));
+        for (int i = 1; i < k; i++) {
+            newNode(centers.row(i));
         }
+        _firstChild[idNode] = firstChild;
 
         // for each cluster builds a child recursively
-        for (int i = 0; i < _k; i++) {
+        for (int i = 0; i < k; i++) {
 
             int newLevel = level + 1;
-            int childId = idChild(idNode, i);
+            int childId = firstChild + i;
 
             if (fromFile) {
 
@@ -243,10 +884,7 @@ VocTree::buildNodeGen(
 
             }
 
-            int childIdx = _index[childId];
-            centers.row(i).copyTo(_centers.row(childIdx));
-
-            showProgress(_k, idNode, level, i);
+            showProgress(_levelK[0], k, idNode, level, i);
 
         }
 
@@ -257,33 +895,6 @@ VocTree::buildNodeGen(
 }
 
 
-int
-VocTree::idChild(int idNode, int numChild) {
-
-    // --------------------
-    // Computing child ids:
-    // --------------------
-    // Tree Example K = 2
-    // the childs of node 5 are nodes (11 and 12):
-    // 0 | 1 2 | 3 4 5 6 | 7 8 9 10 11 12 13 14
-    //               x              xx xx
-    // - node 5 is on 2nd level.
-    // - Using geometric sum = (K^n - 1) / (K - 1)
-    // - 2nd level starts at: sl := (2^2 - 1)/(2-1) = 3
-    // - 3rd level starts at: nl := (2^3 - 1)/(2-1) = 7
-    // - each node preceding to 5 has k children,
-    //		diff := 5 - sl = 2 nodes
-    // - then child(i) of 5 is at: nl + K*diff + i = 11 + i
-    // --------------------
-    // But,
-    // child(i) = nl + K*diff + i = nl + K* [ id - [(K^n - 1) / (K - 1)]] + i =
-    //  = nl - (K^(n+1) - K)/(K-1) + K*id + i = [K*id + 1 + i].
-
-    return (_k * idNode) + 1 + numChild;
-
-}
-
-
 void
 VocTree::buildNodeFromFile(int idNode,
                            int level,
@@ -380,9 +991,26 @@ VocTree::addElements(Catalog<DBElem> &catalog, int startImage) {
     mp.setRow(startingRow);
 
     _invIdx.resize(_usedLeaves);
-    mp.setRow(0);
 
-    // For each image
+    // the leaf index of each descriptor is stored in the words file, one row per descriptor.
+    // An update appends to it only if it holds the words of all the previous images
+    string fileWords = fm.file(FileManager::WORDS);
+    MatPersistor mpWords(fileWords);
+    bool storeWords;
+    if (startImage == 0) {
+        // create() leaves the file closed
+        storeWords = mpWords.create(1, CV_32S) && mpWords.openWrite();
+    } else {
+        storeWords = mpWords.exists() && mpWords.openWrite() && mpWords.rows() == startingRow;
+    }
+    if (!storeWords) {
+        cout << "warning! the words file is not updated" << endl;
+    }
+    Mat words;
+
+    QueryContext ctx;
+
+    // For each image
     for (int idFile = startImage; idFile < catalog.size(); idFile++) {
 
         DBElem info = catalog.get(idFile);
@@ -393,24 +1021,41 @@ VocTree::addElements(Catalog<DBElem> &catalog, int startImage) {
         Mat descriptors;
         mp.read(descriptors, info.featuresCount);
 
+        // quantizes all the image descriptors at once
+        findPaths(descriptors, ctx, false);
+        const vector<int> &paths = ctx.paths;
+        int stride = ctx.pathStride;
+
+        words.create(descriptors.rows, 1, CV_32S);
+
         // add each descriptor, to the inverted file index
         for (int d = 0; d < descriptors.rows; d++) {
 
-            Mat descriptor = descriptors.row(d);
-            int idLeaf = findLeaf(descriptor);
-            int idxNode = _index[idLeaf];
-            int idxLeaf = _indexLeaves[idxNode];
+            // the leaf is the last node of the path
+            const int *path = &paths[d * stride];
+            int l = 0;
+            while (l + 1 < stride && path[l + 1] != -1) {
+                l++;
+            }
+            int idLeaf = path[l];
+            int idxLeaf = _indexLeaves[idLeaf];
 
             vector<int> &invIdx = _invIdx.at(idxLeaf);
             invIdx.push_back(idFile);
             _totDescriptors++;
 
+            words.at<int>(d) = idxLeaf;
+
+        }
 
+        if (storeWords) {
+            mpWords.append(words, descriptors.rows);
         }
 
     }
 
     mp.close();
+    mpWords.close();
 
 
 }
@@ -423,11 +1068,15 @@ VocTree::buildNodes() {
     _totDescriptors = 0;
 
 
-    // A kd-tree of L levels has #nodes = [ k^(L+1) - k ] / [ k - 1 ]
-    // (see paper section 3) note this equation does not take in account the root
-    //_nNodes = (pow(k, _h + 1) - k)/ (k - 1);
-    // this equation does consider the root:
-    _nNodes = (pow(_k, _h + 1) - 1) / (_k - 1);
+    // A complete tree has 1 + k0 + k0 k1 + ... + k0 k1 ... k(H-1) nodes
+    // (see paper section 3, with the same K for all the levels)
+    double levelNodes = 1;
+    double nNodes = 1;
+    for (int level = 0; level < _h; level++) {
+        levelNodes *= _levelK[level];
+        nNodes += levelNodes;
+    }
+    _nNodes = (int) min(nNodes, (double) INT_MAX);
 
     cout << "creating nodes... " << endl;
 
@@ -443,28 +1092,25 @@ VocTree::buildNodes() {
     _centType = mp.type();
     mp.close();
 
-    // fills the indexes with 0s
-    _index.assign(_nNodes, 0);
-    _indexLeaves.resize(_nNodes);
-
-    // create center buffer and expands it
-    // for example. (K=10, h=6, dim=128x4) => approx. 543 MB
+    // nodes tables grow as nodes are created,
+    // memory is proportional to the used nodes (not to the complete tree)
+    _firstChild.clear();
+    _indexLeaves.clear();
     _centers.create(0, _centDim, _centType);
-    expand(_centers, _nNodes);
 
-    // Creates root node.
-    createNode(0, 0, fileDescriptors);
+    // Creates root node (the root has no center, it is never compared).
+    int idRoot = newNode(Mat::zeros(1, _centDim, _centType));
+    createNode(idRoot, 0, fileDescriptors);
 
-    // reduce buffers to gain some memory
-    //_index.resize(_usedNodes);
-    _indexLeaves.resize(_usedNodes);
-    shrink(_centers, _usedNodes);
+    // renumbers the nodes in breadth first order
+    layoutNodes();
 
 
 }
 
 
-VocTree::VocTree(int k, int h, Catalog<DBElem> &images, string &path, bool reuseVocabulary, int useNorm
+VocTree::VocTree(vector<int> &levelK, int h, Catalog<DBElem> &images, string &path, bool reuseVocabulary, int useNorm,
+                 int scoring, string &quantizer
         //int kmeansAtt,
         //TermCriteria crit
 ) {
@@ -474,6 +1120,11 @@ VocTree::VocTree(int k, int h, Catalog<DBElem> &images, string &path, bool reuse
     bool reuseInvIdx = false;
 
     _path = path;
+    _vectorsFormat = VECTORS_FORMAT;
+    _beamWidth = 1;
+    _beamRatio = 0;
+    _cascadeLevel = 0;
+    _cascadeCandidates = 0;
     FileManager fileMgr(_path);
     string prefix = fileMgr.mapData("voctree_");
     string fileInfo = prefix + "info.xml";
@@ -482,6 +1133,7 @@ VocTree::VocTree(int k, int h, Catalog<DBElem> &images, string &path, bool reuse
     string fileVectors = prefix + "vectors.bin";
     string nodesPrefix = prefix + "nodes";
     string fileMinDistances = prefix + "minDistances.bin";
+    string fileHnsw = prefix + "hnsw.bin";
 
     if (reuseVocabulary) {
 
@@ -491,12 +1143,19 @@ VocTree::VocTree(int k, int h, Catalog<DBElem> &images, string &path, bool reuse
         cout << "loading nodes" << endl;
         loadNodes(nodesPrefix);
 
+        _scoring = scoring;
+
     } else {
 
-        _k = k;
         _h = h;
+        setLevelK(levelK);
         _dbSize = images.size();
         _useNorm = useNorm;
+        _scoring = scoring;
+
+        // by default all the levels are used for scoring
+        _minLevel = 0;
+        _maxLevel = h;
 
         buildNodes();
 
@@ -505,6 +1164,14 @@ VocTree::VocTree(int k, int h, Catalog<DBElem> &images, string &path, bool reuse
 
     }
 
+    selectKernels();
+
+    // the images are indexed with the quantizer of the database.
+    // A graph over the leaves of a previous vocabulary is not valid (see useHnsw)
+    remove(fileHnsw.c_str());
+    _quantizerSpec = quantizer;
+    applyQuantizer();
+
 
     if (reuseInvIdx) {
 
@@ -524,6 +1191,27 @@ VocTree::VocTree(int k, int h, Catalog<DBElem> &images, string &path, bool reuse
 
     computeVectors();
 
+    if (compactNodes()) {
+
+        cout << "storing nodes" << endl;
+        storeNodes(nodesPrefix);
+
+        cout << "storing inverted indexes..." << endl;
+        storeInvIdx(fileInvIdx);
+
+        // the leaves were renumbered, the graph is built again for the remaining ones
+        remove(fileHnsw.c_str());
+        applyQuantizer();
+
+    }
+
+    if (!_legacyOrder.empty()) {
+        // the vocabulary was loaded from the old format, stores it with the current one
+        cout << "storing nodes" << endl;
+        storeNodes(nodesPrefix);
+        _legacyOrder.clear();
+    }
+
     cout << "storing weights..." << endl;
     storeWeights(fileWeights);
 
@@ -546,10 +1234,49 @@ VocTree::showInfo() {
     std::cout << "-----------------------------" << endl;
     std::cout << "VocTree Info: " << endl;
     std::cout << ">max height (H): " << _h << endl;
-    std::cout << ">children by node (K): " << _k << endl;
+    std::cout << ">children by node (K): ";
+    int descentCost = 0;
+    for (int level = 0; level < _h; level++) {
+        std::cout << (level > 0 ? "," : "") << _levelK[level];
+        descentCost += _levelK[level];
+    }
+    std::cout << endl;
+    std::cout << ">distances per descriptor: " << descentCost << endl;
     std::cout << ">DB file count: " << _dbSize << endl;
     std::cout << ">total nodes: " << _usedNodes << endl;
     std::cout << ">total leaves: " << _usedLeaves << endl;
+    std::cout << ">scoring levels: " << _minLevel << " to " << _maxLevel << endl;
+    std::cout << ">scoring norm: " << getScoringName(_scoring) << endl;
+    std::cout << ">quantizer: " << (_quantizer.empty() ? "tree" : _quantizer->name())
+              << " (database: " << _quantizerSpec << ")" << endl;
+    std::cout << ">quantized centers: " << (_l2SqrU8 != NULL ? "yes" : "no") << endl;
+    // number of levels with a closest child kernel specialized for their branch factor
+    int specialized = 0;
+    for (unsigned int level = 0; level < _closestL2.size(); level++) {
+        specialized += (_closestL2[level] != NULL);
+    }
+    for (unsigned int level = 0; level < _closestHamming.size(); level++) {
+        specialized += (_closestHamming[level] != NULL);
+    }
+    std::cout << ">distance kernel: ";
+    if (_l2Sqr != NULL) {
+        std::cout << "L2 " << Distance::l2SqrName();
+    } else if (_hamming != NULL) {
+        std::cout << "Hamming " << Distance::hammingName();
+    }
+    if (_l2Sqr != NULL || _hamming != NULL) {
+        if (specialized > 0) {
+            std::cout << " (specialized on " << specialized << " of " << _h << " levels)";
+        }
+        std::cout << endl;
+    } else {
+        std::cout << "cv::norm" << endl;
+    }
+    size_t postingsMemory = 0;
+    for (unsigned int idx = 0; idx < _dVectors.size(); idx++) {
+        postingsMemory += _dVectors[idx].memory();
+    }
+    std::cout << ">d-vectors memory: " << (postingsMemory / MEGA) << " MB" << endl;
     std::cout << "-----------------------------" << endl;
 
 }
@@ -569,6 +1296,7 @@ VocTree::update(Catalog<DBElem> &images) {
     string fileInvIdx = prefix + "invIdx.bin";
     string fileWeights = prefix + "weights.bin";
     string fileVectors = prefix + "vectors.bin";
+    string nodesPrefix = prefix + "nodes";
 
     std::cout << "loading inverted indexes..." << endl;
     loadInvIdx(fileInvIdx);
@@ -584,6 +1312,13 @@ VocTree::update(Catalog<DBElem> &images) {
 
     computeVectors();
 
+    if (!_legacyOrder.empty()) {
+        // nodes were loaded from the old format, stores them with the current one
+        std::cout << "storing nodes" << endl;
+        storeNodes(nodesPrefix);
+        _legacyOrder.clear();
+    }
+
     std::cout << "storing weights..." << endl;
     storeWeights(fileWeights);
 
@@ -607,6 +1342,13 @@ VocTree::loadInfo(string &fileName) {
 
     _k = (int) file["k"];
     _h = (int) file["h"];
+
+    // databases stored before the branch factor could change per level use _k for all of them
+    vector<int> levelK;
+    if (!file["levelK"].empty()) {
+        file["levelK"] >> levelK;
+    }
+    setLevelK(levelK);
     _useNorm = (int) file["useNorm"];
     _dbSize = (int) file["dbSize"];
     _nNodes = (int) file["nNodes"];
@@ -614,6 +1356,140 @@ VocTree::loadInfo(string &fileName) {
     _usedLeaves = (int) file["nextIdLeaf"];
     _totDescriptors = (int) file["totDescriptors"];
 
+    // databases stored before the compressed d-vectors have no format (raw format)
+    _vectorsFormat = (int) file["vectorsFormat"];
+
+    // databases stored before the scoring levels window use all the levels
+    _minLevel = file["minLevel"].empty() ? 0 : (int) file["minLevel"];
+    _maxLevel = file["maxLevel"].empty() ? _h : (int) file["maxLevel"];
+
+    // databases stored before the scoring norms were selectable use L1
+    _scoring = file["scoring"].empty() ? SCORING_L1 : (int) file["scoring"];
+
+    // databases stored before the quantizers were selectable use the tree descent
+    _quantizerSpec = file["quantizer"].empty() ? "tree" : (string) file["quantizer"];
+
+}
+
+
+void
+VocTree::showLevels() {
+
+    double totPostings = 0;
+    double totMass = 0;
+    for (unsigned int l = 0; l < _levelStats.size(); l++) {
+        totPostings += _levelStats[l].postings;
+        totMass += _levelStats[l].mass;
+    }
+
+    std::cout << "-----------------------------" << endl;
+    std::cout << "Score by level (scoring levels: " << _minLevel << " to " << _maxLevel << ")" << endl;
+    std::cout << "level\tnodes\tpostings\tpostings%\tmass%\tmean weight" << endl;
+    for (unsigned int l = 0; l < _levelStats.size(); l++) {
+
+        LevelStats &stats = _levelStats[l];
+        bool used = ((int) l >= _minLevel && (int) l <= _maxLevel);
+
+        std::cout << (used ? "*" : " ") << l
+                  << "\t" << stats.nodes
+                  << "\t" << (long) stats.postings
+                  << "\t" << (totPostings > 0 ? 100 * stats.postings / totPostings : 0)
+                  << "\t" << (totMass > 0 ? 100 * stats.mass / totMass : 0)
+                  << "\t" << (stats.usedNodes > 0 ? stats.weights / stats.usedNodes : 0)
+                  << endl;
+
+    }
+    std::cout << "(*) levels used for scoring" << endl;
+    std::cout << "-----------------------------" << endl;
+
+}
+
+
+void
+VocTree::reportLevels() {
+
+    FileManager fileMgr(_path);
+    string fileInvIdx = fileMgr.mapData("voctree_") + "invIdx.bin";
+
+    // d-vectors are recomputed (with the same window), computing the levels statistics
+    std::cout << "loading inverted indexes..." << endl;
+    loadInvIdx(fileInvIdx);
+    computeVectors();
+    _invIdx.clear();
+
+}
+
+
+void
+VocTree::setBeam(int width, float ratio) {
+
+    if (width < 1 || (ratio != 0 && ratio < 1)) {
+        cerr << "invalid beam, the width must be at least 1 and the ratio 0 or at least 1" << endl;
+        return;
+    }
+
+    _beamWidth = width;
+    _beamRatio = ratio;
+
+    if (_beamWidth > 1) {
+        cout << "beam descent: width " << _beamWidth << ", ratio " << _beamRatio << endl;
+    }
+
+}
+
+
+void
+VocTree::setScoringLevels(int minLevel, int maxLevel) {
+
+    if (minLevel < 0 || maxLevel > _h || minLevel > maxLevel) {
+        cerr << "invalid scoring levels, must be 0 <= min <= max <= " << _h << endl;
+        return;
+    }
+
+    FileManager fileMgr(_path);
+    string prefix = fileMgr.mapData("voctree_");
+    string fileInfo = prefix + "info.xml";
+    string fileInvIdx = prefix + "invIdx.bin";
+    string fileWeights = prefix + "weights.bin";
+    string fileVectors = prefix + "vectors.bin";
+    string nodesPrefix = prefix + "nodes";
+
+    _minLevel = minLevel;
+    _maxLevel = maxLevel;
+
+    std::cout << "loading inverted indexes..." << endl;
+    loadInvIdx(fileInvIdx);
+    computeVectors();
+    _invIdx.clear();
+
+    // the cascade must stay inside the new window (see setCascade),
+    // and its forward index is rebuilt from the new d-vectors
+    if (_cascadeLevel > 0) {
+        if (_cascadeLevel < _minLevel || _cascadeLevel >= _maxLevel) {
+            cerr << "warning! the cascade level " << _cascadeLevel << " is out of the scoring levels, "
+                 << "the cascade is disabled" << endl;
+            setCascade(0, _cascadeCandidates);
+        } else {
+            buildForwardIndex();
+        }
+    }
+
+    if (!_legacyOrder.empty()) {
+        // nodes were loaded from the old format, stores them with the current one
+        std::cout << "storing nodes" << endl;
+        storeNodes(nodesPrefix);
+        _legacyOrder.clear();
+    }
+
+    std::cout << "storing weights..." << endl;
+    storeWeights(fileWeights);
+
+    std::cout << "storing d-vectors..." << endl;
+    storeVectors(fileVectors);
+
+    std::cout << "storing info" << endl;
+    storeInfo(fileInfo);
+
 }
 
 
@@ -621,55 +1497,72 @@ void
 VocTree::computeVectors() {
 
     _weights.create(_usedNodes, 1, CV_32F);
-    _dVectors.resize(_usedNodes);
+
+    // d-vectors are computed uncompressed, since they must be normalized
+    vector<vector<Posting> > dVectors(_usedNodes);
+
+    LevelStats empty = {0, 0, 0, 0, 0};
+    _levelStats.assign(_h + 1, empty);
 
     vector<IIFEntry> invIdx;
     cout << "computing d-vectors..." << endl;
-    computeInvertedIndex(0, 0, invIdx);
+    computeInvertedIndex(0, 0, invIdx, dVectors);
 
 
     // normalize d-vectors
-    //L1 Normalization of each row of d vectors
+    // Normalization of each row of d vectors with the scoring norm
     // see equation 3 on section 4:
     // (computes:  d / || d ||)
 
-    cout << "normalizing d-vectors...";
-    // we compute norm L1
-    vector<float> sum(_dbSize, 0);
-    for (unsigned int idx = 0; idx < _dVectors.size(); idx++) {
-        vector<DComponent> &comps = _dVectors.at(idx);
+    cout << "normalizing d-vectors (" << getScoringName(_scoring) << ")...";
+    vector<double> sum(_dbSize, 0);
+    for (unsigned int idx = 0; idx < dVectors.size(); idx++) {
+        vector<Posting> &comps = dVectors.at(idx);
         for (unsigned int pos = 0; pos < comps.size(); pos++) {
-            DComponent &dc = comps.at(pos);
-            sum.at(dc.idFile) += dc.value; // L1
-            //sum.at( dc.idFile ) += (dc.value * dc.value); // L2
-
+            Posting &dc = comps.at(pos);
+            if (_scoring == SCORING_L2) {
+                sum.at(dc.idFile) += (dc.value * dc.value);
+            } else {
+                sum.at(dc.idFile) += dc.value;
+            }
         }
     }
     cout << " ... " << endl;
-    long count = 0;
-    for (unsigned int idx = 0; idx < _dVectors.size(); idx++) {
-        vector<DComponent> &comps = _dVectors.at(idx);
+    for (unsigned int idx = 0; idx < dVectors.size(); idx++) {
+        vector<Posting> &comps = dVectors.at(idx);
         for (unsigned int pos = 0; pos < comps.size(); pos++) {
-            DComponent &dc = comps.at(pos);
-            //dc.value = sqrt( dc.value / sum.at( dc.idFile )); // Hellinger Kernel
-            dc.value /= sum.at(dc.idFile); // L1
-            //dc.value /= sqrt( sum.at( dc.idFile ) ); //L2
-            count++;
+            Posting &dc = comps.at(pos);
+            dc.value = normalizeValue(dc.value, sum.at(dc.idFile));
         }
     }
 
+    cout << "compressing d-vectors..." << endl;
+    _dVectors.clear();
+    _dVectors.resize(_usedNodes);
+    for (unsigned int idx = 0; idx < dVectors.size(); idx++) {
+        _dVectors[idx].encode(dVectors[idx], _dbSize);
+        vector<Posting>().swap(dVectors[idx]);
+    }
+
+    if (_cascadeLevel > 0) {
+        // the forward index follows the d-vectors
+        buildForwardIndex();
+    }
+
+    showLevels();
+
     return;
 
 }
 
 
 void
-VocTree::computeInvertedIndex(int idNode, int level, vector<IIFEntry> &out) {
+VocTree::computeInvertedIndex(int idNode, int level, vector<IIFEntry> &out,
+                              vector<vector<Posting> > &dVectors) {
 
     if (isLeaf(idNode)) {
 
-        int idxNode = _index[idNode];
-        int idxLeaf = _indexLeaves[idxNode];
+        int idxLeaf = _indexLeaves[idNode];
 
         vector<int> &invIdx = _invIdx.at(idxLeaf);
 
@@ -700,334 +1593,2133 @@ VocTree::computeInvertedIndex(int idNode, int level, vector<IIFEntry> &out) {
 
         // not leaf
 
-        out.clear();
+        out.clear();
+
+        // compute the inverted indexes for all this childs
+        int k = childCount(idNode);
+        vector<vector<IIFEntry> > virtualInvIdx(k);
+        int firstChild = _firstChild[idNode];
+        for (int i = 0; i < k; i++) {
+            int childId = firstChild + i;
+            computeInvertedIndex(childId, level + 1, virtualInvIdx.at(i), dVectors);
+        }
+
+        // now join the child inverted indexes onto the one on the current node.
+        // since, each inverted index is ordered by file id, it is possible to do a sorted merge
+        // to do that, use a vector of K "pointers" to the lower id image in each child inverted index.
+        vector<int> pointers(k, 0);
+        vector<int> toAdvance;
+
+        while (1) {
+
+            toAdvance.clear();
+
+            IIFEntry ent;
+            ent.idFile = INT_MAX;
+            for (int i = 0; i < k; i++) {
+
+                vector<IIFEntry> &invIdx = virtualInvIdx.at(i);
+                unsigned int pos = pointers.at(i);
+                if (pos < invIdx.size()) {
+
+                    if (invIdx.at(pos).idFile < ent.idFile) {
+                        ent = invIdx.at(pos); //does a copy
+                        toAdvance.clear();
+                        toAdvance.push_back(i);
+                    } else if (invIdx.at(pos).idFile == ent.idFile) {
+                        ent.featCount += invIdx.at(pos).featCount;
+                        toAdvance.push_back(i);
+                    }
+
+                }
+
+            }
+
+            if (toAdvance.size() == 0) {
+                // there're no more entries
+                break;
+            }
+
+            // collect the merged entry
+            out.push_back(ent);
+
+            // advance the pointers
+            for (unsigned int i = 0; i < toAdvance.size(); i++) {
+                int idxPointer = toAdvance.at(i);
+                pointers.at(idxPointer)++;
+            }
+
+        }
+
+        // since we don't need any more the child's inverted indexes
+        // let's remove them to free some memory
+        for (int i = 0; i < k; i++) {
+            virtualInvIdx.at(i).clear();
+        }
+
+    }
+
+
+    // Ni: the number of images in the database with at least one descriptor vector path through node i
+    int Ni = out.size();
+    int N = _dbSize;
+    // nodes with no postings get a null weight, like the nodes out of the scoring window
+    float weight = (Ni > 0) ? log((double) N / (double) Ni) : 0;
+
+    // statistics of the level (computed for all the levels, to help choosing the scoring window)
+    LevelStats &stats = _levelStats.at(level);
+    stats.nodes++;
+    stats.postings += Ni;
+    if (Ni > 0) {
+        stats.usedNodes++;
+        stats.weights += weight;
+        for (int pos = 0; pos < Ni; pos++) {
+            stats.mass += weight * out[pos].featCount;
+        }
+    }
+
+    if (level < _minLevel || level > _maxLevel) {
+        // nodes out of the scoring window get a null weight (are ignored by the queries)
+        // and their d-vectors are not stored
+        _weights.at<float>(idNode) = 0;
+        dVectors.at(idNode).clear();
+        return;
+    }
+
+    _weights.at<float>(idNode) = weight;
+    vector<Posting> &comps = dVectors.at(idNode);
+    comps.resize(Ni);
+
+    for (int pos = 0; pos < Ni; pos++) {
+
+        IIFEntry ent = out.at(pos);
+
+        float mji = ent.featCount;
+
+        Posting &dc = comps.at(pos);
+        dc.idFile = ent.idFile;
+        dc.value = weight * mji;
+
+    }
+
+
+}
+
+
+void
+VocTree::loadNodes(string &filePrefix) {
+
+    string fileChildren = filePrefix + ".children";
+    string fileIdx = filePrefix + ".index";
+    string fileLeaves = filePrefix + ".leaves";
+    string fileCenters = filePrefix + ".centers";
+
+    if (!FileHelper::exists(fileChildren) && FileHelper::exists(fileIdx)) {
+        loadLegacyNodes(filePrefix);
+        return;
+    }
+
+    VecPersistor vp;
+    vp.restore(fileChildren, _firstChild);
+    vp.restore(fileLeaves, _indexLeaves);
+
+    Mat centers;
+    MatPersistor mpc(fileCenters);
+    mpc.openRead();
+    mpc.read(centers);
+    mpc.close();
+
+    _centDim = centers.cols;
+    _centType = centers.type();
+    alignCenters(centers);
+    computeNodeLevels();
+
+}
+
+
+void
+VocTree::loadLegacyNodes(string &filePrefix) {
+
+    // In the old format nodes were identified by their position in the complete K-ary tree
+    // (children of node id were K * id + 1 + i) and the ".index" file mapped those ids
+    // to the rows of centers, weights and d-vectors.
+
+    cout << "converting nodes from the old format..." << endl;
+
+    string fileIdx = filePrefix + ".index";
+    string fileLeaves = filePrefix + ".leaves";
+    string fileCenters = filePrefix + ".centers";
+
+    vector<int> index;
+    VecPersistor vp;
+    vp.restore(fileIdx, index);
+    vp.restore(fileLeaves, _indexLeaves);
+
+    MatPersistor mpc(fileCenters);
+    mpc.openRead();
+    mpc.read(_centers);
+    mpc.close();
+
+    _centDim = _centers.cols;
+    _centType = _centers.type();
+
+    vector<long> ids;       // old ids in breadth first order
+    vector<int> order;      // new id -> old row
+    vector<int> firstChild;
+
+    ids.push_back(0);
+    for (unsigned int n = 0; n < ids.size(); n++) {
+        long id = ids[n];
+        int idx = index[id];
+        order.push_back(idx);
+        if (_indexLeaves[idx] != -1) {
+            firstChild.push_back(-1);
+        } else {
+            firstChild.push_back(ids.size());
+            for (int i = 0; i < _k; i++) {
+                ids.push_back(_k * id + 1 + i);
+            }
+        }
+    }
+
+    reorderNodes(order, firstChild);
+
+    // weights and d-vectors are still indexed by the old rows
+    _legacyOrder = order;
+
+}
+
+
+void
+VocTree::reorderVectors() {
+
+    if (_legacyOrder.empty()) {
+        return;
+    }
+
+    Mat weights(_usedNodes, 1, CV_32F);
+    vector<PostingList> dVectors(_usedNodes);
+    for (int n = 0; n < _usedNodes; n++) {
+        int old = _legacyOrder[n];
+        weights.at<float>(n) = _weights.at<float>(old);
+        dVectors[n].swap(_dVectors.at(old));
+    }
+
+    _weights = weights;
+    _dVectors.swap(dVectors);
+
+
+
+}
+
+
+VocTree::VocTree(string &path) {
+
+    bool loadInvertedIndexes = false;
+
+    std::cout << "voctree create" << endl;
+
+    _path = path;
+    _beamWidth = 1;
+    _beamRatio = 0;
+    _cascadeLevel = 0;
+    _cascadeCandidates = 0;
+    FileManager fileMgr(_path);
+    string prefix = fileMgr.mapData("voctree_");
+    string fileInfo = prefix + "info.xml";
+    string fileInvIdx = prefix + "invIdx.bin";
+    string fileWeights = prefix + "weights.bin";
+    string fileVectors = prefix + "vectors.bin";
+    string nodesPrefix = prefix + "nodes";
+
+    std::cout << "loading info" << endl;
+    loadInfo(fileInfo);
+
+    std::cout << "loading nodes" << endl;
+    loadNodes(nodesPrefix);
+
+    selectKernels();
+
+    if (loadInvertedIndexes) {
+
+        std::cout << "loading inverted indexes..." << endl;
+        loadInvIdx(fileInvIdx);
+
+    }
+
+    std::cout << "loading weights..." << endl;
+    loadWeights(fileWeights);
+
+    std::cout << "loading d-vectors..." << endl;
+    loadVectors(fileVectors);
+
+    reorderVectors();
+
+    applyQuantizer();
+
+    std::cout << "voctree loaded" << endl;
+
+    showInfo();
+
+}
+
+
+void
+VocTree::selectKernels() {
+
+    Distance::init();
+
+    _l2Sqr = NULL;
+    _closestL2.assign(_h, NULL);
+    _centerNorms.clear();
+    if (_useNorm == NORM_L2 && _centType == CV_32F) {
+        _l2Sqr = Distance::l2Sqr();
+        for (int level = 0; level < _h; level++) {
+            _closestL2[level] = Distance::closestL2(_levelK[level], _centDim);
+        }
+
+        // precomputes the centers squared norms for the batched descent
+        vector<float> zeros(_centDim, 0);
+        _centerNorms.resize(_usedNodes);
+        for (int n = 0; n < _usedNodes; n++) {
+            _centerNorms[n] = _l2Sqr(_centers.ptr<float>(n), &zeros[0], _centDim);
+        }
+    }
+
+    _hamming = NULL;
+    _closestHamming.assign(_h, NULL);
+    if (_useNorm == NORM_HAMMING && _centType == CV_8U) {
+        _hamming = Distance::hamming(_centDim);
+        for (int level = 0; level < _h; level++) {
+            _closestHamming[level] = Distance::closestHamming(_levelK[level], _centDim);
+        }
+    }
+
+    // codes are built on demand, for the current centers
+    _l2SqrU8 = NULL;
+    _centerCodes.release();
+
+}
+
+
+void
+VocTree::quantizeCenters() {
+
+    _codeMin.assign(_centDim, 0);
+    _codeInvScale.assign(_centDim, 1);
+    _codeWeights.assign(_centDim, 1);
+
+    // each dimension is mapped from its range over all the centers to [0, 255]
+    double errorSqr = 0;
+    for (int j = 0; j < _centDim; j++) {
+
+        float minVal = 0, maxVal = 0;
+        for (int n = 0; n < _usedNodes; n++) {
+            float v = _centers.ptr<float>(n)[j];
+            if (n == 0 || v < minVal) {
+                minVal = v;
+            }
+            if (n == 0 || v > maxVal) {
+                maxVal = v;
+            }
+        }
+
+        float scale = (maxVal - minVal) / 255;
+        if (scale <= 0) {
+            scale = 1;
+        }
+        _codeMin[j] = minVal;
+        _codeInvScale[j] = 1 / scale;
+        _codeWeights[j] = scale * scale;
+
+        // rounding moves a center at most half a step per dimension
+        errorSqr += scale * scale / 4;
+
+    }
+    _codeError = (float) sqrt(errorSqr);
+
+    _centerCodes.create(_usedNodes, _centDim, CV_8U);
+    for (int n = 0; n < _usedNodes; n++) {
+        const float *pCenter = _centers.ptr<float>(n);
+        uchar *pCode = _centerCodes.ptr<uchar>(n);
+        for (int j = 0; j < _centDim; j++) {
+            pCode[j] = saturate_cast<uchar>(cvRound((pCenter[j] - _codeMin[j]) * _codeInvScale[j]));
+        }
+    }
+
+}
+
+
+void
+VocTree::useQuantizedCenters(bool enable) {
+
+    if (!enable) {
+        _l2SqrU8 = NULL;
+        _centerCodes.release();
+        return;
+    }
+
+    if (_l2Sqr == NULL) {
+        cerr << "quantized centers are only supported for float L2 descriptors" << endl;
+        return;
+    }
+
+    quantizeCenters();
+    _l2SqrU8 = Distance::l2SqrU8();
+
+    cout << "quantized centers: " << (_centerCodes.total() / MEGA) << " MB, error bound " << _codeError << endl;
+
+}
+
+
+void
+VocTree::setQuantizer(Ptr<Quantizer> quantizer) {
+
+    // the leaves map is built here, so that concurrent queries do not build it
+    if (_leafNodes.empty()) {
+        mapLeaves();
+    }
+    _quantizer = quantizer;
+
+}
+
+
+void
+VocTree::useHnsw(int M, int efConstruction, int ef) {
+
+    if (M <= 0) {
+        _quantizer.release();
+        return;
+    }
+
+    if (_l2Sqr == NULL && _hamming == NULL) {
+        cerr << "the hnsw quantizer is only supported for float L2 and binary descriptors" << endl;
+        return;
+    }
+
+    if (_leafNodes.empty()) {
+        mapLeaves();
+    }
+
+    FileManager fileMgr(_path);
+    string fileHnsw = fileMgr.mapData("voctree_hnsw.bin");
+
+    // the stored graph is reused if it was built with the same (limited) parameters
+    HnswQuantizer::limitParams(M, efConstruction);
+    Ptr<HnswQuantizer> hnsw = new HnswQuantizer(_centers, _leafNodes);
+    if (!hnsw->load(fileHnsw) || hnsw->getM() != M || hnsw->getEfConstruction() != efConstruction) {
+        hnsw->build(M, efConstruction);
+        hnsw->store(fileHnsw);
+    }
+    hnsw->setEf(ef);
+
+    cout << "hnsw quantizer: M " << hnsw->getM() << ", efConstruction " << hnsw->getEfConstruction()
+         << ", ef " << ef << endl;
+    setQuantizer(hnsw);
+
+}
+
+
+void
+VocTree::applyQuantizer() {
+
+    int M, efConstruction, ef;
+    if (!parseQuantizer(_quantizerSpec, M, efConstruction, ef)) {
+        cerr << "invalid quantizer " << _quantizerSpec << ", using the tree descent" << endl;
+        _quantizerSpec = "tree";
+    }
+    useHnsw(M, efConstruction, ef);
+
+}
+
+
+// quantizes the descriptors on the calling thread, and returns the fraction of them that get
+// the expected word. The time per descriptor is returned in micros, measured once the scratch
+// has been used by a first descriptor (as it is by the queries of a running server)
+static double measureQuantizer(Quantizer &quantizer, Mat &descriptors, const vector<int> &expected,
+                               double &micros) {
+
+    int rows = descriptors.rows;
+    vector<int> words(rows);
+    Ptr<Quantizer::Scratch> scratch = quantizer.createScratch();
+    quantizer.quantize(descriptors, 0, 1, &words[0], *scratch);
+
+    int64 start = getTickCount();
+    quantizer.quantize(descriptors, 0, rows, &words[0], *scratch);
+    micros = 1e6 * (getTickCount() - start) / getTickFrequency() / rows;
+
+    int hits = 0;
+    for (int r = 0; r < rows; r++) {
+        hits += (words[r] == expected[r]);
+    }
+    return (double) hits / rows;
+
+}
+
+
+void
+VocTree::benchmarkQuantizers(Mat &descriptors, int M, int efConstruction) {
+
+    if (_l2Sqr == NULL && _hamming == NULL) {
+        cerr << "quantizers can only be compared for float L2 and binary descriptors" << endl;
+        return;
+    }
+    if (descriptors.rows == 0 || descriptors.cols != _centDim || descriptors.type() != _centType) {
+        cerr << "invalid descriptors for the quantizers comparison" << endl;
+        return;
+    }
+
+    if (_leafNodes.empty()) {
+        mapLeaves();
+    }
+
+    cout << "finding the closest leaf of " << descriptors.rows << " descriptors ("
+         << _usedLeaves << " leaves)..." << endl;
+    Ptr<Quantizer> exact(new ExactQuantizer(this));
+    vector<int> expected;
+    vector<Ptr<Quantizer::Scratch> > scratch;
+    Ptr<Quantizer> owner;
+    quantizeWords(exact, descriptors, expected, scratch, owner);
+
+    double micros;
+    double recall;
+
+    TreeQuantizer tree(this);
+    recall = measureQuantizer(tree, descriptors, expected, micros);
+    cout << tree.name() << ": recall@1 " << recall << ", " << micros << " us per descriptor" << endl;
+
+    FileManager fileMgr(_path);
+    string fileHnsw = fileMgr.mapData("voctree_hnsw.bin");
+    HnswQuantizer::limitParams(M, efConstruction);
+    HnswQuantizer hnsw(_centers, _leafNodes);
+    if (!hnsw.load(fileHnsw) || hnsw.getM() != M || hnsw.getEfConstruction() != efConstruction) {
+        hnsw.build(M, efConstruction);
+        hnsw.store(fileHnsw);
+    }
+
+    for (int ef = 16; ef <= 512; ef *= 2) {
+        hnsw.setEf(ef);
+        recall = measureQuantizer(hnsw, descriptors, expected, micros);
+        cout << hnsw.name() << " (M " << hnsw.getM() << ", ef " << ef << "): recall@1 " << recall << ", "
+             << micros << " us per descriptor" << endl;
+    }
+
+}
+
+
+VocTree::~VocTree() {
+    cout << "voctree delete" << endl;
+}
+
+
+int
+VocTree::findClosestChild(Mat &descriptor, int idNode) {
+
+    // children are contiguous, so are their centers:
+    // the scan is a single pass over a block of k rows.
+    int level = _nodeLevels[idNode];
+    int k = _levelK[level];
+    int firstChild = _firstChild[idNode];
+    const uchar *pCenter = _centers.ptr(firstChild);
+    size_t step = _centers.step;
+
+    int idClosest = firstChild;
+
+    if (_l2SqrU8 != NULL) {
+
+        // the descriptor is expressed in code units, and compared with the codes of the children
+        const float *pDescr = descriptor.ptr<float>(0);
+        AutoBuffer<float> scaled(_centDim);
+        for (int j = 0; j < _centDim; j++) {
+            scaled[j] = (pDescr[j] - _codeMin[j]) * _codeInvScale[j];
+        }
+
+        AutoBuffer<float> dists(k);
+        const uchar *pCode = _centerCodes.ptr(firstChild);
+        size_t codeStep = _centerCodes.step;
+
+        float minDist = -1;
+        for (int i = 0; i < k; i++, pCode += codeStep) {
+            dists[i] = _l2SqrU8(scaled, pCode, &_codeWeights[0], _centDim);
+            if (i == 0 || dists[i] < minDist) {
+                minDist = dists[i];
+                idClosest = firstChild + i;
+            }
+        }
+
+        // codes are at most _codeError away from their centers, so a child can only be closer
+        // than the chosen one if its approximate distance is within 2 * _codeError of the minimum
+        // (with a small slack for the float rounding).
+        // Those children are compared with the float centers.
+        float bound = sqrt(minDist) * 1.0001f + 2 * _codeError;
+        bound *= bound;
+        int ties = 0;
+        for (int i = 0; i < k; i++) {
+            if (dists[i] <= bound) {
+                ties++;
+            }
+        }
+
+        if (ties > 1) {
+            float minExact = -1;
+            for (int i = 0; i < k; i++, pCenter += step) {
+                if (dists[i] <= bound) {
+                    float d = _l2Sqr(pDescr, (const float *) pCenter, _centDim);
+                    if (minExact < 0 || d < minExact) {
+                        minExact = d;
+                        idClosest = firstChild + i;
+                    }
+                }
+            }
+        }
+
+    } else if (_closestL2[level] != NULL) {
+
+        // specialized scan for the branch factor of the level and the dimension of the tree
+        idClosest = firstChild + _closestL2[level](descriptor.ptr<float>(0), pCenter, step);
+
+    } else if (_closestHamming[level] != NULL) {
+
+        idClosest = firstChild + _closestHamming[level](descriptor.ptr<uchar>(0), pCenter, step);
+
+    } else if (_l2Sqr != NULL) {
+
+        // fast path: squared L2 distance on raw center pointers
+        // (the order of the distances is the same as for the L2 norm)
+        const float *pDescr = descriptor.ptr<float>(0);
+
+        float minDist = -1;
+        for (int i = 0; i < k; i++, pCenter += step) {
+
+            float d = _l2Sqr(pDescr, (const float *) pCenter, _centDim);
+            if (i == 0 || d < minDist) {
+                minDist = d;
+                idClosest = firstChild + i;
+            }
+
+        }
+
+    } else if (_hamming != NULL) {
+
+        // fast path: popcount based Hamming distance for binary descriptors
+        const uchar *pDescr = descriptor.ptr<uchar>(0);
+
+        int minBits = 0;
+        for (int i = 0; i < k; i++, pCenter += step) {
+
+            int d = _hamming(pDescr, pCenter, _centDim);
+            if (i == 0 || d < minBits) {
+                minBits = d;
+                idClosest = firstChild + i;
+            }
+
+        }
+
+    } else {
+
+        float minDist = -1;
+        for (int i = 0; i < k; i++) {
+
+            int childId = firstChild + i;
+
+            float d = norm(descriptor, _centers.row(childId), _useNorm);
+            if (i == 0 || d < minDist) {
+                minDist = d;
+                idClosest = childId;
+            }
+
+        }
+
+    }
+
+    return idClosest;
+
+}
+
+
+void
+VocTree::childDistances(Mat &descriptor, int idNode, float *dists) {
+
+    int k = childCount(idNode);
+    int firstChild = _firstChild[idNode];
+    const uchar *pCenter = _centers.ptr(firstChild);
+    size_t step = _centers.step;
+
+    if (_l2Sqr != NULL) {
+
+        const float *pDescr = descriptor.ptr<float>(0);
+        for (int i = 0; i < k; i++, pCenter += step) {
+            dists[i] = sqrt(_l2Sqr(pDescr, (const float *) pCenter, _centDim));
+        }
+
+    } else if (_hamming != NULL) {
+
+        const uchar *pDescr = descriptor.ptr<uchar>(0);
+        for (int i = 0; i < k; i++, pCenter += step) {
+            dists[i] = (float) _hamming(pDescr, pCenter, _centDim);
+        }
+
+    } else {
+
+        for (int i = 0; i < k; i++) {
+            dists[i] = (float) norm(descriptor, _centers.row(firstChild + i), _useNorm);
+        }
+
+    }
+
+}
+
+
+void
+VocTree::findPaths(Mat &descriptors, QueryContext &ctx, bool useBeam) {
+
+    int rows = descriptors.rows;
+
+    if (!_quantizer.empty()) {
+        // the paths are rebuilt from the words found by the quantizer
+        quantizeWords(_quantizer, descriptors, ctx.words, ctx.quantizeScratch, ctx.scratchOwner);
+        wordPaths(rows > 0 ? &ctx.words[0] : NULL, rows, ctx);
+        return;
+    }
+
+    // a beam path holds the root and up to _beamWidth nodes per level
+    ctx.soft = (useBeam && _beamWidth > 1);
+    ctx.pathStride = ctx.soft ? 1 + _h * _beamWidth : _h + 1;
+    int stride = ctx.pathStride;
+
+    ctx.paths.assign(rows * stride, -1);
+    if (ctx.soft) {
+        ctx.votes.assign(rows * stride, 0);
+    }
+
+    // small queries are quantized by the calling thread
+    int nChunks = min(getNumThreads(), rows / QUANTIZE_MIN_ROWS);
+    if (nChunks < 1) {
+        nChunks = 1;
+    }
+    if ((int) ctx.descent.size() < nChunks) {
+        ctx.descent.resize(nChunks);
+    }
+
+    DescentBody body(this, &descriptors, &ctx, nChunks);
+    if (nChunks == 1) {
+        body(Range(0, 1));
+    } else {
+        parallel_for_(Range(0, nChunks), body);
+    }
+
+}
+
+
+void
+VocTree::descend(Mat &descriptors, int rowStart, int rowEnd,
+                 QueryContext::DescentScratch &scratch, vector<int> &paths) {
+
+    int rows = rowEnd - rowStart;
+    int stride = _h + 1;
+
+    // (current node, descriptor row) of the descriptors that have not reached a leaf yet
+    vector<pair<int, int> > &active = scratch.active;
+    vector<pair<int, int> > &next = scratch.next;
+    active.clear();
+    for (int r = rowStart; r < rowEnd; r++) {
+        paths[r * stride] = 0;
+        if (!isLeaf(0)) {
+            active.push_back(make_pair(0, r));
+        }
+    }
+
+    // with the 8 bits centers every group is compared with the codes (see findClosestChild):
+    // the matrix multiplication would read the float centers, which the codes are meant to avoid
+    bool batched = (_l2Sqr != NULL && _l2SqrU8 == NULL && descriptors.type() == CV_32F);
+    if (batched && (scratch.group.rows < rows || scratch.group.cols != _centDim)) {
+        // scratch is only reallocated when a bigger query arrives
+        scratch.group.create(rows, _centDim, CV_32F);
+        scratch.products.create(rows, min(_k, GEMM_MAX_CHILDREN), CV_32F);
+    }
+
+    for (int level = 1; !active.empty(); level++) {
+
+        // groups the descriptors by their current node
+        sort(active.begin(), active.end());
+        next.clear();
+
+        size_t start = 0;
+        while (start < active.size()) {
+
+            int idNode = active[start].first;
+            size_t end = start;
+            while (end < active.size() && active[end].first == idNode) {
+                end++;
+            }
+            int count = (int) (end - start);
+            int firstChild = _firstChild[idNode];
+            int k = _levelK[level - 1];
+
+            // a level with a kernel specialized for its branch factor and the dimension (see selectKernels)
+            // is scanned with it whatever the size of the group, the matrix multiplication is only
+            // used for the other levels
+            if (batched && count >= GEMM_MIN_ROWS && _closestL2[level - 1] == NULL) {
+
+                // gathers the descriptors of the group
+                Mat group = scratch.group.rowRange(0, count);
+                for (int g = 0; g < count; g++) {
+                    memcpy(group.ptr<float>(g),
+                           descriptors.ptr<float>(active[start + g].second),
+                           _centDim * sizeof(float));
+                }
+
+                // ||q||^2 is the same for every child, the closest one minimizes ||c||^2 - 2 q.c
+                vector<int> &bestChild = scratch.bestChild;
+                vector<float> &bestDist = scratch.bestDist;
+                bestChild.assign(count, 0);
+                bestDist.assign(count, numeric_limits<float>::max());
+
+                // products = Q.C^T, for each block of contiguous children centers
+                for (int blockStart = 0; blockStart < k; blockStart += GEMM_MAX_CHILDREN) {
+
+                    int blockSize = min(GEMM_MAX_CHILDREN, k - blockStart);
+                    int blockFirst = firstChild + blockStart;
+                    Mat children = _centers.rowRange(blockFirst, blockFirst + blockSize);
+                    Mat products = scratch.products.rowRange(0, count).colRange(0, blockSize);
+                    gemm(group, children, 1.0, noArray(), 0.0, products, GEMM_2_T);
+
+                    const float *pNorms = &_centerNorms[blockFirst];
+                    for (int g = 0; g < count; g++) {
+                        const float *pProd = products.ptr<float>(g);
+                        for (int i = 0; i < blockSize; i++) {
+                            float d = pNorms[i] - 2 * pProd[i];
+                            if (d < bestDist[g]) {
+                                bestDist[g] = d;
+                                bestChild[g] = blockStart + i;
+                            }
+                        }
+                    }
+
+                }
+
+                for (int g = 0; g < count; g++) {
+
+                    int r = active[start + g].second;
+                    int idChild = firstChild + bestChild[g];
+                    paths[r * stride + level] = idChild;
+                    if (!isLeaf(idChild)) {
+                        next.push_back(make_pair(idChild, r));
+                    }
+
+                }
+
+            } else {
+
+                for (size_t g = start; g < end; g++) {
+
+                    int r = active[g].second;
+                    Mat descriptor = descriptors.row(r);
+                    int idChild = findClosestChild(descriptor, idNode);
+                    paths[r * stride + level] = idChild;
+                    if (!isLeaf(idChild)) {
+                        next.push_back(make_pair(idChild, r));
+                    }
+
+                }
+
+            }
+
+            start = end;
+
+        }
+
+        active.swap(next);
+
+    }
+
+}
+
+
+void
+VocTree::descendBeam(Mat &descriptors, int rowStart, int rowEnd,
+                     QueryContext::DescentScratch &scratch, QueryContext &ctx) {
+
+    int stride = ctx.pathStride;
+
+    vector<pair<int, float> > &beam = scratch.beam;
+    vector<pair<int, float> > &nextBeam = scratch.nextBeam;
+    vector<pair<float, int> > &candidates = scratch.candidates;
+    scratch.dists.resize(_k);
+    float *dists = &scratch.dists[0];
+
+    for (int r = rowStart; r < rowEnd; r++) {
+
+        int *path = &ctx.paths[r * stride];
+        float *votes = &ctx.votes[r * stride];
+        int n = 0;
+
+        path[n] = 0;
+        votes[n] = 1;
+        n++;
+
+        beam.clear();
+        if (!isLeaf(0)) {
+            beam.push_back(make_pair(0, 1.0f));
+        }
+
+        Mat descriptor = descriptors.row(r);
+        while (!beam.empty()) {
+
+            // the children of all the nodes of the beam compete for the next level
+            candidates.clear();
+            float levelVote = 0;
+            for (size_t b = 0; b < beam.size(); b++) {
+                int idNode = beam[b].first;
+                int firstChild = _firstChild[idNode];
+                childDistances(descriptor, idNode, dists);
+                for (int i = 0; i < childCount(idNode); i++) {
+                    candidates.push_back(make_pair(dists[i], firstChild + i));
+                }
+                levelVote += beam[b].second;
+            }
+
+            int keep = min((int) candidates.size(), _beamWidth);
+            partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end());
+
+            float dMin = candidates[0].first;
+            if (_beamRatio > 0) {
+                while (keep > 1 && candidates[keep - 1].first > _beamRatio * dMin) {
+                    keep--;
+                }
+            }
+
+            // the vote is shared in inverse proportion to the distances
+            float total = 0;
+            for (int c = 0; c < keep; c++) {
+                candidates[c].first = (dMin + BEAM_EPS) / (candidates[c].first + BEAM_EPS);
+                total += candidates[c].first;
+            }
+
+            nextBeam.clear();
+            for (int c = 0; c < keep; c++) {
+
+                int idChild = candidates[c].second;
+                float vote = levelVote * candidates[c].first / total;
+
+                path[n] = idChild;
+                votes[n] = vote;
+                n++;
+
+                // the vote of a leaf ends there
+                if (!isLeaf(idChild)) {
+                    nextBeam.push_back(make_pair(idChild, vote));
+                }
+
+            }
+
+            beam.swap(nextBeam);
+
+        }
+
+    }
+
+}
+
+
+int
+VocTree::findLeaf(Mat &descriptor) {
+
+    int idNode = 0;
+
+    while (!isLeaf(idNode)) {
+
+        // Search the closest center
+        idNode = findClosestChild(descriptor, idNode);
+    }
+
+
+    return idNode;
+
+}
+
+
+void
+VocTree::query(Mat &descriptors, vector<Matching> &result, int limit) {
+    query(descriptors, _queryCtx, result, limit);
+}
+
+
+void
+VocTree::query(Mat &descriptors, QueryContext &ctx, vector<Matching> &result, int limit) {
+
+    // quantizes all the query descriptors at once
+    findPaths(descriptors, ctx, true);
+    computeTerms(ctx, ctx, 0, descriptors.rows);
+
+    scoreQuery(ctx, result, limit);
+
+}
+
+
+void
+VocTree::warmQueryContext(int limit) {
+
+    if (_usedNodes < 2) {
+        return;
+    }
+
+    // the centers of the nodes below the root descend along their own paths
+    int rows = QUANTIZE_MIN_ROWS * max(getNumThreads(), 1);
+    Mat descriptors(rows, _centDim, _centType);
+    for (int r = 0; r < rows; r++) {
+        int idNode = 1 + r % (_usedNodes - 1);
+        _centers.row(idNode).colRange(0, _centDim).copyTo(descriptors.row(r));
+    }
+
+    vector<Matching> result;
+    query(descriptors, _queryCtx, result, limit);
+
+}
+
+
+int
+VocTree::queryAnytime(Mat &descriptors, vector<Matching> &result, int limit, int64 deadline) {
+
+    QueryContext &ctx = _queryCtx;
+
+    // the first chunk is small, and the next ones take the time left at the speed measured so far,
+    // up to a size that all the threads quantize at once (see findPaths)
+    int maxChunkRows = max(ANYTIME_MIN_ROWS, QUANTIZE_MIN_ROWS * max(getNumThreads(), 1));
+    int chunkRows = ANYTIME_MIN_ROWS;
+    int64 start = getTickCount();
+
+    // paths of the chunks quantized so far
+    vector<int> &paths = ctx.anytimePaths;
+    vector<float> &votes = ctx.anytimeVotes;
+    paths.clear();
+    votes.clear();
+
+    int rows = 0;
+    while (rows < descriptors.rows) {
+
+        int64 now = getTickCount();
+        if (rows > 0 && now >= deadline) {
+            break;
+        }
+        if (rows > 0 && deadline != LLONG_MAX) {
+            double ticksPerRow = (double) (now - start) / rows;
+            double fit = (deadline - now) / max(ticksPerRow, 1.0);
+            chunkRows = (int) min((double) maxChunkRows, max((double) ANYTIME_MIN_ROWS, fit));
+        } else if (rows > 0) {
+            chunkRows = maxChunkRows;
+        }
+
+        int end = min(rows + chunkRows, descriptors.rows);
+        Mat chunk = descriptors.rowRange(rows, end);
+        findPaths(chunk, ctx, true);
+        paths.insert(paths.end(), ctx.paths.begin(), ctx.paths.end());
+        if (ctx.soft) {
+            votes.insert(votes.end(), ctx.votes.begin(), ctx.votes.end());
+        }
+        rows = end;
+
+    }
+
+    ctx.paths.swap(paths);
+    ctx.votes.swap(votes);
+    computeTerms(ctx, ctx, 0, rows);
+
+    scoreQuery(ctx, result, limit);
+
+    return rows;
+
+}
+
+
+void
+VocTree::scoreQuery(QueryContext &ctx, vector<Matching> &result, int limit) {
+
+    bool cascade = splitCascade(ctx, limit);
+    int stageLimit = cascade ? max(limit, _cascadeCandidates) : limit;
+
+    int nBlocks = prepareScores(ctx);
+
+    // the image id space is divided into blocks, and consecutive blocks are grouped into stripes.
+    // Each stripe is scored by a single thread with no locks, applying every posting list to
+    // one block at a time (posting lists are seeked by image id).
+    int nStripes = min(nBlocks, getNumThreads() * STRIPES_PER_THREAD);
+    if (nStripes < 1) {
+        nStripes = 1;
+    }
+    ctx.cursors.resize(nStripes * ctx.terms.size());
+    // accumulators are left zeroed after each block, so they are only initialized once
+    ctx.denseAcc.resize(nStripes * SCORE_BLOCK, 0);
+    ctx.limit = max(stageLimit, 0);
+    ctx.best.resize(nStripes * ctx.limit);
+
+    ScoringBody body(this, &ctx, nStripes, nBlocks);
+    if (nBlocks == 0) {
+        // empty database
+    } else if (nStripes == 1) {
+        body(Range(0, 1));
+    } else {
+        parallel_for_(Range(0, nStripes), body);
+    }
+
+    selectResults(ctx, result, stageLimit);
+
+    if (cascade) {
+        finishCascade(ctx, result, limit);
+    }
+
+}
+
+
+bool
+VocTree::splitCascade(QueryContext &ctx, int limit) {
+
+    // with the cascade, the first stage scores the images only with the nodes up to _cascadeLevel
+    // (short posting lists), and selects the candidates that are rescored by the second stage
+    if (_cascadeLevel <= 0 || limit <= 0) {
+        return false;
+    }
+
+    vector<QueryContext::QTerm> &terms = ctx.terms;
+    vector<QueryContext::QTerm> &fineTerms = ctx.fineTerms;
+    fineTerms.clear();
+    unsigned int nCoarse = 0;
+    for (unsigned int t = 0; t < terms.size(); t++) {
+        if (_nodeLevels[terms[t].idNode] <= _cascadeLevel) {
+            terms[nCoarse++] = terms[t];
+        } else {
+            fineTerms.push_back(terms[t]);
+        }
+    }
+    terms.resize(nCoarse);
+
+    return true;
+
+}
+
+
+void
+VocTree::finishCascade(QueryContext &ctx, vector<Matching> &result, int limit) {
+
+    if (_scoring == SCORING_L1) {
+        rescoreCandidates<MinScoring>(ctx, result);
+    } else {
+        rescoreCandidates<DotScoring>(ctx, result);
+    }
+
+    size_t k = min(result.size(), (size_t) limit);
+    partial_sort(result.begin(), result.begin() + k, result.end());
+    result.resize(k);
+
+    double zeroEps = 1e-03;
+    for (unsigned int i = 0; i < k; i++) {
+        if (result[i].score < zeroEps) {
+            result[i].score = 0;
+        }
+    }
+
+}
+
+
+template<class Scoring>
+void
+VocTree::rescoreCandidates(QueryContext &ctx, vector<Matching> &candidates) {
+
+    // the fine terms are spread on the (zeroed) dense query vector
+    vector<float> &q = ctx.q;
+    if (q.size() != (size_t) _usedNodes) {
+        q.assign(_usedNodes, 0);
+    }
+    const vector<QueryContext::QTerm> &fineTerms = ctx.fineTerms;
+    for (unsigned int t = 0; t < fineTerms.size(); t++) {
+        q[fineTerms[t].idNode] = fineTerms[t].value;
+    }
+
+    // each candidate adds the terms of its own deep nodes, read from the forward index
+    for (unsigned int c = 0; c < candidates.size(); c++) {
+
+        int idFile = candidates[c].id;
+        double score = candidates[c].score;
+        for (int f = _forwardStart[idFile]; f < _forwardStart[idFile + 1]; f++) {
+            float qi = q[_forwardNodes[f]];
+            if (qi > 0) {
+                score -= 2 * Scoring::term(qi, _forwardValues[f]);
+            }
+        }
+        candidates[c].score = score;
+
+    }
+
+    for (unsigned int t = 0; t < fineTerms.size(); t++) {
+        q[fineTerms[t].idNode] = 0;
+    }
+
+}
+
+
+void
+VocTree::setCascade(int level, int candidates) {
+
+    if (level == 0) {
+        _cascadeLevel = 0;
+        vector<int>().swap(_forwardStart);
+        vector<int>().swap(_forwardNodes);
+        vector<float>().swap(_forwardValues);
+        return;
+    }
+
+    if (level < _minLevel || level >= _maxLevel || candidates < 1) {
+        cerr << "invalid cascade, the level must be between " << _minLevel << " and " << (_maxLevel - 1)
+             << ", and the candidates at least 1" << endl;
+        return;
+    }
+
+    _cascadeLevel = level;
+    _cascadeCandidates = candidates;
+    buildForwardIndex();
+
+    cout << "cascade scoring: levels up to " << _cascadeLevel << ", " << _cascadeCandidates << " candidates, "
+         << "forward index " << (_forwardNodes.size() * (sizeof(int) + sizeof(float)) / MEGA) << " MB" << endl;
+
+}
+
+
+void
+VocTree::buildForwardIndex() {
+
+    // the postings of the nodes deeper than the cascade level are transposed (grouped by image)
+    vector<Posting> postings;
+    _forwardStart.assign(_dbSize + 1, 0);
+    for (int idNode = 0; idNode < _usedNodes; idNode++) {
+        if (_nodeLevels[idNode] > _cascadeLevel) {
+            _dVectors[idNode].decode(postings);
+            for (unsigned int p = 0; p < postings.size(); p++) {
+                _forwardStart[postings[p].idFile + 1]++;
+            }
+            postings.clear();
+        }
+    }
+    for (int idFile = 0; idFile < _dbSize; idFile++) {
+        _forwardStart[idFile + 1] += _forwardStart[idFile];
+    }
+
+    _forwardNodes.resize(_forwardStart[_dbSize]);
+    _forwardValues.resize(_forwardStart[_dbSize]);
+    vector<int> fill(_forwardStart.begin(), _forwardStart.end() - 1);
+    for (int idNode = 0; idNode < _usedNodes; idNode++) {
+        if (_nodeLevels[idNode] > _cascadeLevel) {
+            _dVectors[idNode].decode(postings);
+            for (unsigned int p = 0; p < postings.size(); p++) {
+                int f = fill[postings[p].idFile]++;
+                _forwardNodes[f] = idNode;
+                _forwardValues[f] = postings[p].value;
+            }
+            postings.clear();
+        }
+    }
+
+}
+
+
+void
+VocTree::queryStream(Mat &descriptors, StreamSession &session, vector<Matching> &result, int limit) {
+
+    QueryContext &ctx = session.ctx;
+
+    if (_scoring == SCORING_L1) {
+        query(descriptors, ctx, result, limit);
+        return;
+    }
+
+    findPaths(descriptors, ctx, true);
+    collectTerms(ctx, ctx, 0, descriptors.rows);
+
+    // with the dot product scorings, the score of an image is 2 - 2 * dot(v, d) / |v|,
+    // where v is the unnormalized query vector (the square roots of the values for Hellinger)
+    vector<QueryContext::QTerm> &terms = ctx.terms;
+    double sum = 0;
+    for (unsigned int t = 0; t < terms.size(); t++) {
+        if (_scoring == SCORING_HELLINGER) {
+            terms[t].value = sqrt(terms[t].value);
+        }
+        sum += terms[t].value * terms[t].value;
+    }
+
+    // changes of the query vector since the last frame (both vectors are sorted by node)
+    vector<QueryContext::QTerm> &values = session.values;
+    vector<QueryContext::QTerm> &changes = session.changes;
+    changes.clear();
+    unsigned int i = 0, j = 0;
+    while (i < values.size() || j < terms.size()) {
+        QueryContext::QTerm change;
+        if (j == terms.size() || (i < values.size() && values[i].idNode < terms[j].idNode)) {
+            change.idNode = values[i].idNode;
+            change.value = -values[i].value;
+            i++;
+        } else if (i == values.size() || terms[j].idNode < values[i].idNode) {
+            change = terms[j];
+            j++;
+        } else {
+            change.idNode = terms[j].idNode;
+            change.value = terms[j].value - values[i].value;
+            i++;
+            j++;
+        }
+        if (change.value != 0) {
+            changes.push_back(change);
+        }
+    }
+
+    // the frame is scored from scratch when the session is new or old,
+    // or when it changes more nodes than the frame has
+    bool refresh = (session.dots.size() != (size_t) _dbSize ||
+                    session.frames >= STREAM_REFRESH_FRAMES ||
+                    changes.size() >= terms.size());
+    if (refresh) {
+
+        if (session.dots.size() != (size_t) _dbSize) {
+            session.dots.assign(_dbSize, 0);
+            session.listed.assign(_dbSize, 0);
+        } else {
+            for (unsigned int k = 0; k < session.images.size(); k++) {
+                session.dots[session.images[k]] = 0;
+                session.listed[session.images[k]] = 0;
+            }
+        }
+        session.images.clear();
+        session.frames = 0;
+
+        for (unsigned int t = 0; t < terms.size(); t++) {
+            applyStreamTerm(session, terms[t].idNode, terms[t].value);
+        }
+
+    } else {
+
+        session.frames++;
+        for (unsigned int c = 0; c < changes.size(); c++) {
+            applyStreamTerm(session, changes[c].idNode, changes[c].value);
+        }
+
+    }
+
+    values.assign(terms.begin(), terms.end());
+
+    // images with no dot product left (every shared node has changed) leave the session,
+    // the others are the candidates
+    vector<Matching> &candidates = ctx.candidates;
+    candidates.clear();
+    float scale = (sum > 0) ? (float) (2 / sqrt(sum)) : 0;
+    float minDot = (float) (STREAM_DOT_EPS * sqrt(sum));
+    unsigned int nListed = 0;
+    for (unsigned int k = 0; k < session.images.size(); k++) {
+        int idFile = session.images[k];
+        float dot = session.dots[idFile];
+        if (dot > minDot) {
+            session.images[nListed++] = idFile;
+            candidates.push_back(Matching(idFile, 2 - scale * dot));
+        } else {
+            session.dots[idFile] = 0;
+            session.listed[idFile] = 0;
+        }
+    }
+    session.images.resize(nListed);
+
+    size_t k = min(candidates.size(), (size_t) max(limit, 0));
+    partial_sort(candidates.begin(), candidates.begin() + k, candidates.end());
+
+    double zeroEps = 1e-03;
+    result.clear();
+    for (unsigned int c = 0; c < k; c++) {
+        Matching &match = candidates[c];
+        if (match.score < zeroEps) {
+            match.score = 0;
+        }
+        result.push_back(match);
+    }
+
+}
+
+
+bool
+VocTree::isStreamIncremental() {
+    return _scoring != SCORING_L1;
+}
+
+
+void
+VocTree::applyStreamTerm(StreamSession &session, int idNode, float value) {
+
+    const PostingList &comps = _dVectors[idNode];
+    int ids[PostingList::BLOCK];
+    float values[PostingList::BLOCK];
+    for (int b = 0; b < comps.blocks(); b++) {
+        int count = comps.decodeBlock(b, ids, values);
+        for (int i = 0; i < count; i++) {
+            int idFile = ids[i];
+            if (!session.listed[idFile]) {
+                session.listed[idFile] = 1;
+                session.images.push_back(idFile);
+            }
+            session.dots[idFile] += value * values[i];
+        }
+    }
+
+}
+
+
+void
+VocTree::queryWords(Mat &words, vector<Matching> &result, int limit) {
+
+    QueryContext &ctx = _queryCtx;
+    Mat column = words.isContinuous() ? words : words.clone();
+    wordPaths(column.ptr<int>(), column.rows, ctx);
+
+    computeTerms(ctx, ctx, 0, words.rows);
+
+    scoreQuery(ctx, result, limit);
+
+}
+
+
+void
+VocTree::wordPaths(const int *words, int rows, QueryContext &ctx) {
+
+    if (_leafNodes.empty()) {
+        mapLeaves();
+    }
+
+    // the paths are rebuilt from the leaves, going up to the root
+    int stride = _h + 1;
+    ctx.soft = false;
+    ctx.pathStride = stride;
+    ctx.paths.assign(rows * stride, -1);
+
+    for (int r = 0; r < rows; r++) {
+
+        int idxLeaf = words[r];
+        if (idxLeaf < 0 || idxLeaf >= _usedLeaves) {
+            continue;
+        }
+
+        int idNode = _leafNodes[idxLeaf];
+        int level = 0;
+        for (int n = idNode; n != 0; n = _parents[n]) {
+            level++;
+        }
+
+        int *path = &ctx.paths[r * stride];
+        for (int n = idNode; level >= 0; level--) {
+            path[level] = n;
+            n = _parents[n];
+        }
+
+    }
+
+}
+
+
+void
+VocTree::mapLeaves() {
+
+    _parents.assign(_usedNodes, -1);
+    _leafNodes.assign(_usedLeaves, -1);
+    for (int idNode = 0; idNode < _usedNodes; idNode++) {
+        if (isLeaf(idNode)) {
+            _leafNodes[_indexLeaves[idNode]] = idNode;
+        } else {
+            for (int i = 0; i < childCount(idNode); i++) {
+                _parents[_firstChild[idNode] + i] = idNode;
+            }
+        }
+    }
+
+}
+
+
+void
+VocTree::queryBatch(vector<Mat> &queries, vector<vector<Matching> > &results, int limit) {
+
+    int nQueries = queries.size();
+    results.resize(nQueries);
+
+    if ((int) _batchCtx.size() < QUERY_BATCH) {
+        _batchCtx.resize(QUERY_BATCH);
+    }
+
+    Mat descriptors;
+    vector<int> rowStarts(QUERY_BATCH + 1);
+    vector<unsigned int> pointers(QUERY_BATCH);
+
+    for (int first = 0; first < nQueries; first += QUERY_BATCH) {
+
+        int count = min(QUERY_BATCH, nQueries - first);
+
+        // quantizes the descriptors of all the queries of the group together
+        descriptors.release();
+        rowStarts[0] = 0;
+        for (int j = 0; j < count; j++) {
+            Mat &qDescrs = queries[first + j];
+            if (qDescrs.rows > 0) {
+                descriptors.push_back(qDescrs);
+            }
+            rowStarts[j + 1] = descriptors.rows;
+        }
+
+        findPaths(descriptors, _batchCtx[0], true);
+
+        bool cascade = false;
+        for (int j = 0; j < count; j++) {
+            computeTerms(_batchCtx[j], _batchCtx[0], rowStarts[j], rowStarts[j + 1]);
+            cascade = splitCascade(_batchCtx[j], limit);
+            pointers[j] = 0;
+        }
+        int stageLimit = cascade ? max(limit, _cascadeCandidates) : limit;
+
+        // the terms of each query are sorted by node, so they are merged in node order:
+        // each visited node is listed once, with the queries that visited it
+        _batchNodes.clear();
+        _batchStarts.clear();
+        _batchSlots.clear();
+        _batchValues.clear();
+        while (1) {
+
+            int idNode = INT_MAX;
+            for (int j = 0; j < count; j++) {
+                vector<QueryContext::QTerm> &terms = _batchCtx[j].terms;
+                if (pointers[j] < terms.size() && terms[pointers[j]].idNode < idNode) {
+                    idNode = terms[pointers[j]].idNode;
+                }
+            }
+
+            if (idNode == INT_MAX) {
+                // there're no more terms
+                break;
+            }
+
+            _batchNodes.push_back(idNode);
+            _batchStarts.push_back(_batchSlots.size());
+            for (int j = 0; j < count; j++) {
+                vector<QueryContext::QTerm> &terms = _batchCtx[j].terms;
+                if (pointers[j] < terms.size() && terms[pointers[j]].idNode == idNode) {
+                    _batchSlots.push_back(j);
+                    _batchValues.push_back(terms[pointers[j]].value);
+                    pointers[j]++;
+                }
+            }
+
+        }
+        _batchStarts.push_back(_batchSlots.size());
+
+        int nBlocks = 0;
+        for (int j = 0; j < count; j++) {
+            nBlocks = prepareScores(_batchCtx[j]);
+        }
+
+        // the group is scored by stripes of image blocks like a single query (see scoreQuery):
+        // every posting block is decoded once for all the queries that visited its node
+        int nStripes = min(nBlocks, getNumThreads() * STRIPES_PER_THREAD);
+        if (nStripes < 1) {
+            nStripes = 1;
+        }
+        _batchCursors.resize(nStripes * _batchNodes.size());
+        _batchDense.resize(nStripes * SCORE_BLOCK);
+        for (int j = 0; j < count; j++) {
+            QueryContext &ctx = _batchCtx[j];
+            ctx.denseAcc.resize(nStripes * SCORE_BLOCK, 0);
+            ctx.limit = max(stageLimit, 0);
+            ctx.best.resize(nStripes * ctx.limit);
+        }
+
+        BatchScoringBody body(this, count, nStripes, nBlocks);
+        if (nBlocks == 0) {
+            // empty database
+        } else if (nStripes == 1) {
+            body(Range(0, 1));
+        } else {
+            parallel_for_(Range(0, nStripes), body);
+        }
+
+        for (int j = 0; j < count; j++) {
+            selectResults(_batchCtx[j], results[first + j], stageLimit);
+            if (cascade) {
+                finishCascade(_batchCtx[j], results[first + j], limit);
+            }
+        }
+
+    }
+
+}
+
+
+void
+VocTree::computeTerms(QueryContext &ctx, const QueryContext &source, int rowStart, int rowEnd) {
+
+    double sum = collectTerms(ctx, source, rowStart, rowEnd);
+
+    //Now normalize q vector
+    vector<QueryContext::QTerm> &terms = ctx.terms;
+    if (_scoring == SCORING_L2) {
+        sum = 0;
+        for (unsigned int t = 0; t < terms.size(); t++) {
+            sum += terms[t].value * terms[t].value;
+        }
+    }
+    for (unsigned int t = 0; t < terms.size(); t++) {
+        terms[t].value = normalizeValue(terms[t].value, sum);
+    }
+
+}
+
 
-        // compute the inverted indexes for all this childs
-        vector<vector<IIFEntry> > virtualInvIdx(_k);
-        for (int i = 0; i < _k; i++) {
-            int childId = idChild(idNode, i);
-            computeInvertedIndex(childId, level + 1, virtualInvIdx.at(i));
-        }
+double
+VocTree::collectTerms(QueryContext &ctx, const QueryContext &source, int rowStart, int rowEnd) {
 
-        // now join the child inverted indexes onto the one on the current node.
-        // since, each inverted index is ordered by file id, it is possible to do a sorted merge
-        // to do that, use a vector of K "pointers" to the lower id image in each child inverted index.
-        vector<int> pointers(_k, 0);
-        vector<int> toAdvance;
+    const vector<int> &paths = source.paths;
+    int stride = source.pathStride;
 
-        while (1) {
+    // q is kept zeroed between queries, it is only cleared when the tree size changes
+    vector<float> &q = ctx.q;
+    if (q.size() != (size_t) _usedNodes) {
+        q.assign(_usedNodes, 0);
+    }
 
-            toAdvance.clear();
+    vector<int> &visited = ctx.visited;
+    visited.clear();
 
-            IIFEntry ent;
-            ent.idFile = INT_MAX;
-            for (int i = 0; i < _k; i++) {
+    double sum = 0;
+    for (int i = rowStart; i < rowEnd; i++) {
 
-                vector<IIFEntry> &invIdx = virtualInvIdx.at(i);
-                unsigned int pos = pointers.at(i);
-                if (pos < invIdx.size()) {
+        const int *path = &paths[i * stride];
+        // soft votes of the beam descent (a greedy path votes 1 on each node)
+        const float *votes = source.soft ? &source.votes[i * stride] : NULL;
 
-                    if (invIdx.at(pos).idFile < ent.idFile) {
-                        ent = invIdx.at(pos); //does a copy
-                        toAdvance.clear();
-                        toAdvance.push_back(i);
-                    } else if (invIdx.at(pos).idFile == ent.idFile) {
-                        ent.featCount += invIdx.at(pos).featCount;
-                        toAdvance.push_back(i);
-                    }
+        // computes qi = ni * wi (see paper 4.1)
+        for (int l = 0; l < stride && path[l] != -1; l++) {
 
-                }
+            int idxNode = path[l];
 
-            }
+            // nodes with null weight do not contribute to the score
+            float weight = _weights.at<float>(idxNode);
+            if (weight > 0) {
 
-            if (toAdvance.size() == 0) {
-                // there're no more entries
-                break;
-            }
+                if (votes != NULL) {
+                    weight *= votes[l];
+                }
 
-            // collect the merged entry
-            out.push_back(ent);
+                if (q[idxNode] == 0) {
+                    visited.push_back(idxNode);
+                }
+                q[idxNode] += weight;
+                sum += weight;
 
-            // advance the pointers
-            for (unsigned int i = 0; i < toAdvance.size(); i++) {
-                int idxPointer = toAdvance.at(i);
-                pointers.at(idxPointer)++;
             }
 
         }
 
-        // since we don't need any more the child's inverted indexes
-        // let's remove them to free some memory
-        for (int i = 0; i < _k; i++) {
-            virtualInvIdx.at(i).clear();
-        }
+    }
 
+    // collects the sparse q vector, sorted by node to scan the d-vectors in memory order
+    sort(visited.begin(), visited.end());
+    vector<QueryContext::QTerm> &terms = ctx.terms;
+    terms.resize(visited.size());
+    for (unsigned int t = 0; t < visited.size(); t++) {
+        int idxNode = visited[t];
+        terms[t].idNode = idxNode;
+        terms[t].value = q[idxNode];
+        q[idxNode] = 0;
     }
 
+    return sum;
 
-    // Ni: the number of images in the database with at least one descriptor vector path through node i
-    int Ni = out.size();
-    int N = _dbSize;
-    float weight = log((double) N / (double) Ni);
+}
 
-    int idxNode = _index[idNode];
-    _weights.at<float>(idxNode) = weight;
-    vector<DComponent> &comps = _dVectors.at(idxNode);
-    comps.resize(Ni);
 
-    for (int pos = 0; pos < Ni; pos++) {
+float
+VocTree::normalizeValue(float value, double sum) {
 
-        IIFEntry ent = out.at(pos);
+    if (_scoring == SCORING_L2) {
+        return (float) (value / sqrt(sum));
+    }
+    if (_scoring == SCORING_HELLINGER) {
+        return (float) sqrt(value / sum);
+    }
+    return (float) (value / sum);
 
-        float mji = ent.featCount;
+}
 
-        DComponent &dc = comps.at(pos);
-        dc.idFile = ent.idFile;
-        dc.value = weight * mji;
 
+int
+VocTree::prepareScores(QueryContext &ctx) {
+
+    // a new epoch invalidates the scores of the previous query
+    // (scores are only reset when the epoch counter wraps around)
+    if (ctx.scores.size() != (size_t) _dbSize) {
+        ctx.scores.assign(_dbSize, 2);
+        ctx.stamps.assign(_dbSize, 0);
+        ctx.epoch = 0;
+    }
+    ctx.epoch++;
+    if (ctx.epoch == 0) {
+        ctx.stamps.assign(_dbSize, 0);
+        ctx.epoch = 1;
     }
 
+    int nBlocks = (_dbSize + SCORE_BLOCK - 1) / SCORE_BLOCK;
+    ctx.touched.resize(_dbSize);
+    ctx.blockTouched.assign(nBlocks, 0);
+
+    return nBlocks;
 
 }
 
 
 void
-VocTree::loadNodes(string &filePrefix) {
-
-    string fileIdx = filePrefix + ".index";
-    string fileLeaves = filePrefix + ".leaves";
-    string fileCenters = filePrefix + ".centers";
-
-    VecPersistor vp;
-    vp.restore(fileIdx, _index);
-    vp.restore(fileLeaves, _indexLeaves);
+VocTree::selectResults(QueryContext &ctx, vector<Matching> &result, int limit) {
+
+    // images not touched by the query keep the score 2 and are never returned
+    vector<Matching> &candidates = ctx.candidates;
+    candidates.clear();
+    for (unsigned int b = 0; b < ctx.blockTouched.size(); b++) {
+        const int *blockTouched = &ctx.touched[b * SCORE_BLOCK];
+        for (int i = 0; i < ctx.blockTouched[b]; i++) {
+            int idFile = blockTouched[i];
+            candidates.push_back(Matching(idFile, ctx.scores[idFile]));
+        }
+    }
 
-    MatPersistor mpc(fileCenters);
-    mpc.openRead();
-    mpc.read(_centers);
-    mpc.close();
+    // Now, selects the best "limit" candidates (lowest scores) and sorts them.
+    // partial_sort keeps a bounded heap of size limit, O(n log(limit)) instead of sorting all the candidates
+    size_t k = min(candidates.size(), (size_t) max(limit, 0));
+    partial_sort(candidates.begin(), candidates.begin() + k, candidates.end());
 
+    double zeroEps = 1e-03;
+    result.clear();
+    for (unsigned int i = 0; i < k; i++) {
+        Matching &match = candidates[i];
+        if (match.score < zeroEps) {
+            match.score = 0;
+        }
+        result.push_back(match);
+    }
 
 }
 
 
-VocTree::VocTree(string &path) {
+// returns the maximum value of the posting blocks of a list from the position cursor
+// up to the first block starting at or after endId
+static float rangeMax(const PostingList &comps, int cursor, int endId) {
 
-    bool loadInvertedIndexes = false;
+    float dMax = 0;
+    for (int block = cursor / PostingList::BLOCK;
+         block < comps.blocks() && comps.blockFirstId(block) < endId;
+         block++) {
+        dMax = max(dMax, comps.blockMax(block));
+    }
+    return dMax;
 
-    std::cout << "voctree create" << endl;
+}
 
-    _path = path;
-    FileManager fileMgr(_path);
-    string prefix = fileMgr.mapData("voctree_");
-    string fileInfo = prefix + "info.xml";
-    string fileInvIdx = prefix + "invIdx.bin";
-    string fileWeights = prefix + "weights.bin";
-    string fileVectors = prefix + "vectors.bin";
-    string nodesPrefix = prefix + "nodes";
 
-    std::cout << "loading info" << endl;
-    loadInfo(fileInfo);
+void
+VocTree::scoreBatchStripe(int count, int stripe, int nStripes, int nBlocks) {
 
-    std::cout << "loading nodes" << endl;
-    loadNodes(nodesPrefix);
+    if (_scoring == SCORING_L1) {
+        scoreBatchStripeWith<MinScoring>(count, stripe, nStripes, nBlocks);
+    } else {
+        scoreBatchStripeWith<DotScoring>(count, stripe, nStripes, nBlocks);
+    }
 
-    if (loadInvertedIndexes) {
+}
 
-        std::cout << "loading inverted indexes..." << endl;
-        loadInvIdx(fileInvIdx);
 
+template<class Scoring>
+void
+VocTree::scoreBatchStripeWith(int count, int stripe, int nStripes, int nBlocks) {
+
+    int nNodes = _batchNodes.size();
+
+    int firstBlock = (int) ((long) stripe * nBlocks / nStripes);
+    int lastBlock = (int) ((long) (stripe + 1) * nBlocks / nStripes);
+
+    // state of each query of the group in the stripe
+    float *scores[QUERY_BATCH];
+    unsigned int *stamps[QUERY_BATCH];
+    unsigned int epochs[QUERY_BATCH];
+    float *acc[QUERY_BATCH];
+    bool hasDense[QUERY_BATCH];
+    float *best[QUERY_BATCH];
+    int nBest[QUERY_BATCH];
+    int *touched[QUERY_BATCH];
+    int nTouched[QUERY_BATCH];
+    float bounds[QUERY_BATCH];
+    bool active[QUERY_BATCH];
+
+    int limit = _batchCtx[0].limit;
+    for (int j = 0; j < count; j++) {
+        QueryContext &ctx = _batchCtx[j];
+        scores[j] = &ctx.scores[0];
+        stamps[j] = &ctx.stamps[0];
+        epochs[j] = ctx.epoch;
+        acc[j] = &ctx.denseAcc[stripe * SCORE_BLOCK];
+        hasDense[j] = false;
+        best[j] = (limit > 0) ? &ctx.best[stripe * limit] : NULL;
+        nBest[j] = 0;
     }
 
-    std::cout << "loading weights..." << endl;
-    loadWeights(fileWeights);
-
-    std::cout << "loading d-vectors..." << endl;
-    loadVectors(fileVectors);
+    // seeks each posting list to the first image of the stripe
+    int *cursors = (nNodes > 0) ? &_batchCursors[stripe * nNodes] : NULL;
+    int firstId = firstBlock * SCORE_BLOCK;
+    // (dense lists are scored by image id, with no cursor)
+    for (int n = 0; n < nNodes; n++) {
+        const PostingList &comps = _dVectors[_batchNodes[n]];
+        if (comps.isDense()) {
+            cursors[n] = 0;
+            for (int s = _batchStarts[n]; s < _batchStarts[n + 1]; s++) {
+                hasDense[_batchSlots[s]] = true;
+            }
+        } else {
+            cursors[n] = (firstId == 0) ? 0 : comps.seek(firstId);
+        }
+    }
+    float *dense = &_batchDense[stripe * SCORE_BLOCK];
 
-    std::cout << "voctree loaded" << endl;
+    int ids[PostingList::BLOCK];
+    float values[PostingList::BLOCK];
 
-    showInfo();
+    for (int b = firstBlock; b < lastBlock; b++) {
 
-}
+        int startId = b * SCORE_BLOCK;
+        int endId = min((b + 1) * SCORE_BLOCK, _dbSize);
 
+        bool anyFull = false;
+        for (int j = 0; j < count; j++) {
+            touched[j] = &_batchCtx[j].touched[startId];
+            nTouched[j] = 0;
+            bounds[j] = 0;
+            active[j] = true;
+            anyFull = anyFull || (limit > 0 && nBest[j] == limit);
+        }
 
-VocTree::~VocTree() {
-    cout << "voctree delete" << endl;
-}
+        // block pruning (see scoreStripeWith): the maximum di of the posting blocks overlapping
+        // the image block is found once per node, and bounds the score decrease of each query that visited it.
+        // A query that can not improve its stripe top results skips the block
+        if (anyFull) {
+            for (int n = 0; n < nNodes; n++) {
+                const PostingList &comps = _dVectors[_batchNodes[n]];
+                int cursor = comps.isDense() ? startId : cursors[n];
+                float dMax = rangeMax(comps, cursor, endId);
+                for (int s = _batchStarts[n]; s < _batchStarts[n + 1]; s++) {
+                    bounds[_batchSlots[s]] += 2 * Scoring::term(_batchValues[s], dMax);
+                }
+            }
+            for (int j = 0; j < count; j++) {
+                active[j] = !(limit > 0 && nBest[j] == limit && 2 - bounds[j] > best[j][0] + PRUNE_EPS);
+            }
+        }
 
+        for (int n = 0; n < nNodes; n++) {
 
-list<int>
-VocTree::findPath(Mat &descriptor) {
+            const PostingList &comps = _dVectors[_batchNodes[n]];
+            int slotStart = _batchStarts[n];
+            int slotEnd = _batchStarts[n + 1];
 
-    list<int> path;
-    int idNode = 0;
-    unsigned int numCh = _k;
+            bool used = false;
+            for (int s = slotStart; s < slotEnd && !used; s++) {
+                used = active[_batchSlots[s]];
+            }
 
-    path.push_back(idNode);
+            if (comps.isDense()) {
+                if (used) {
+                    // the values of the block are decoded once, and accumulated by each query
+                    comps.decodeDense(startId, endId, dense);
+                    for (int s = slotStart; s < slotEnd; s++) {
+                        int j = _batchSlots[s];
+                        if (active[j]) {
+                            Scoring::addValues(dense, endId - startId, _batchValues[s], acc[j]);
+                        }
+                    }
+                }
+                continue;
+            }
 
-    while (!isLeaf(idNode)) {
+            if (!used) {
+                // no query scores the block, the cursor is moved to the next block
+                int block = cursors[n] / PostingList::BLOCK;
+                if (cursors[n] < comps.end() && comps.blockFirstId(block) < endId) {
+                    cursors[n] = comps.seek(endId);
+                }
+                continue;
+            }
 
-        //Search the closest sub-cluster
-        int idClosest = 0;
-        double minDist = numeric_limits<int>::max();
+            // the cursor is the position of the next posting to be scored:
+            // postings blocks are decoded until one goes beyond the scores block
+            int end = comps.end();
+            int cursor = cursors[n];
+            while (cursor < end) {
 
-        for (size_t i = 0; i < numCh; i++) {
+                int block = cursor / PostingList::BLOCK;
+                if (comps.blockFirstId(block) >= endId) {
+                    break;
+                }
 
-            int childId = idChild(idNode, i);
-            int idxChild = _index[childId];
-            double d = norm(descriptor, _centers.row(idxChild), _useNorm);
+                int nDecoded = comps.decodeBlock(block, ids, values);
+                int pos = cursor % PostingList::BLOCK;
+                for (; pos < nDecoded && ids[pos] < endId; pos++) {
 
-            if (i == 0 || d < minDist) {
-                minDist = d;
-                idClosest = childId;
-            }
+                    float di = values[pos];
+                    int idFile = ids[pos];
 
-        }
+                    for (int s = slotStart; s < slotEnd; s++) {
 
-        idNode = idClosest;
-        path.push_back(idNode);
-    }
+                        int j = _batchSlots[s];
+                        if (!active[j]) {
+                            continue;
+                        }
 
-    return path;
+                        if (stamps[j][idFile] != epochs[j]) {
+                            stamps[j][idFile] = epochs[j];
+                            scores[j][idFile] = 2;
+                            touched[j][nTouched[j]++] = idFile;
+                        }
+                        scores[j][idFile] -= 2 * Scoring::term(_batchValues[s], di);
 
-}
+                    }
 
+                }
 
-int
-VocTree::findLeaf(Mat &descriptor) {
+                if (pos < nDecoded) {
+                    cursor = block * PostingList::BLOCK + pos;
+                    break;
+                }
+                cursor = (block + 1) * PostingList::BLOCK;
 
-    int idNode = 0;
+            }
 
-    while (!isLeaf(idNode)) {
+            cursors[n] = cursor;
 
-        // Search the closest center
-        int idClosest = 0;
-        float minDist = -1;
+        }
 
-        for (int i = 0; i < _k; i++) {
+        for (int j = 0; j < count; j++) {
 
-            int childId = idChild(idNode, i);
+            QueryContext &ctx = _batchCtx[j];
+            if (!active[j]) {
+                ctx.blockTouched[b] = 0;
+                continue;
+            }
 
-            int idxChild = _index[childId];
+            // score decrease of the dense terms
+            if (hasDense[j]) {
+                float *pAcc = acc[j];
+                for (int idFile = startId; idFile < endId; idFile++) {
+                    float m = pAcc[idFile - startId];
+                    if (m <= 0) {
+                        continue;
+                    }
+                    pAcc[idFile - startId] = 0;
+                    if (stamps[j][idFile] != epochs[j]) {
+                        stamps[j][idFile] = epochs[j];
+                        scores[j][idFile] = 2;
+                        touched[j][nTouched[j]++] = idFile;
+                    }
+                    scores[j][idFile] -= 2 * m;
+                }
+            }
 
-            float d = norm(descriptor, _centers.row(idxChild), _useNorm);
-            if (i == 0 || d < minDist) {
-                minDist = d;
-                idClosest = childId;
+            ctx.blockTouched[b] = nTouched[j];
+
+            // scores of the block are final, updates the stripe top results of the query
+            for (int i = 0; i < nTouched[j] && limit > 0; i++) {
+                float score = scores[j][touched[j][i]];
+                if (nBest[j] < limit) {
+                    best[j][nBest[j]++] = score;
+                    push_heap(best[j], best[j] + nBest[j]);
+                } else if (score < best[j][0]) {
+                    pop_heap(best[j], best[j] + nBest[j]);
+                    best[j][nBest[j] - 1] = score;
+                    push_heap(best[j], best[j] + nBest[j]);
+                }
             }
 
         }
 
-        idNode = idClosest;
     }
 
-
-    return idNode;
-
 }
 
 
 void
-VocTree::query(Mat &descriptors, vector<Matching> &result, int limit) {
-
-    vector<float> q(_usedNodes, 0);
-    double sum = 0;
-    for (int i = 0; i < descriptors.rows; i++) {
-
-        Mat qDescr = descriptors.row(i);
+VocTree::scoreStripe(QueryContext &ctx, int stripe, int nStripes, int nBlocks) {
 
-        list<int> path = findPath(qDescr);
-
-        // computes qi = ni * wi (see paper 4.1)
-        list<int>::iterator it = path.begin();
-        for (; it != path.end(); it++) {
+    // the policy is chosen once per stripe, the scoring loops are specialized for it
+    if (_scoring == SCORING_L1) {
+        scoreStripeWith<MinScoring>(ctx, stripe, nStripes, nBlocks);
+    } else {
+        scoreStripeWith<DotScoring>(ctx, stripe, nStripes, nBlocks);
+    }
 
-            int idNode = (*it);
-            int idxNode = _index[idNode];
+}
 
-            float weight = _weights.at<float>(idxNode);
-            if (!(isinf(weight))) {
 
-                q[idxNode] += weight; // L1
-                //q[ idxNode ] += (weight * weight); // L2
-                sum += weight;
+template<class Scoring>
+void
+VocTree::scoreStripeWith(QueryContext &ctx, int stripe, int nStripes, int nBlocks) {
+
+    const vector<QueryContext::QTerm> &terms = ctx.terms;
+    int nTerms = terms.size();
+
+    int firstBlock = (int) ((long) stripe * nBlocks / nStripes);
+    int lastBlock = (int) ((long) (stripe + 1) * nBlocks / nStripes);
+
+    // seeks each posting list to the first image of the stripe
+    int *cursors = (nTerms > 0) ? &ctx.cursors[stripe * nTerms] : NULL;
+    int firstId = firstBlock * SCORE_BLOCK;
+    // (dense lists are scored by image id, with no cursor)
+    bool anyDense = false;
+    for (int t = 0; t < nTerms; t++) {
+        const PostingList &comps = _dVectors[terms[t].idNode];
+        if (comps.isDense()) {
+            anyDense = true;
+            cursors[t] = 0;
+        } else {
+            cursors[t] = (firstId == 0) ? 0 : comps.seek(firstId);
+        }
+    }
+    float *acc = anyDense ? &ctx.denseAcc[stripe * SCORE_BLOCK] : NULL;
+
+    float *scores = &ctx.scores[0];
+    unsigned int *stamps = &ctx.stamps[0];
+    unsigned int epoch = ctx.epoch;
+
+    int ids[PostingList::BLOCK];
+    float values[PostingList::BLOCK];
+
+    // max heap with the best (lowest) scores of the stripe
+    int limit = ctx.limit;
+    float *best = (limit > 0) ? &ctx.best[stripe * limit] : NULL;
+    int nBest = 0;
+
+    for (int b = firstBlock; b < lastBlock; b++) {
+
+        int endId = min((b + 1) * SCORE_BLOCK, _dbSize);
+        int *touched = &ctx.touched[b * SCORE_BLOCK];
+        int nTouched = 0;
+
+        if (limit > 0 && nBest == limit) {
+
+            // each term can decrease the score of an image at most 2 * term(qi, di),
+            // bounded here with the maximum di of the posting blocks overlapping the image block
+            // (terms grow with di)
+            float bound = 0;
+            for (int t = 0; t < nTerms; t++) {
+                const PostingList &comps = _dVectors[terms[t].idNode];
+                // dense blocks hold BLOCK consecutive image ids
+                int cursor = comps.isDense() ? b * SCORE_BLOCK : cursors[t];
+                float dMax = rangeMax(comps, cursor, endId);
+                bound += 2 * Scoring::term(terms[t].value, dMax);
+            }
 
+            // if no image of the block can beat the worst score of the stripe top results,
+            // the block is skipped (the cursors are moved to the next block)
+            if (2 - bound > best[0] + PRUNE_EPS) {
+                for (int t = 0; t < nTerms; t++) {
+                    const PostingList &comps = _dVectors[terms[t].idNode];
+                    int block = cursors[t] / PostingList::BLOCK;
+                    if (!comps.isDense() && cursors[t] < comps.end() && comps.blockFirstId(block) < endId) {
+                        cursors[t] = comps.seek(endId);
+                    }
+                }
+                ctx.blockTouched[b] = 0;
+                continue;
             }
 
         }
 
-    }
-
-    //Now normalize q vector
-    for (unsigned int i = 0; i < q.size(); i++) {
-        //q[i] = sqrt( q[i] / sum ); // Hellinger Kernel?
-        q[i] /= sum; // L1
-        //q[i] /= sum*sum; // L2
-    }
+        //Now perform |q - d| for every d database element of the block
+        for (int t = 0; t < nTerms; t++) {
 
-    //Now perform |q - d| for every d database element
-    result.resize(_dbSize);
+            float qi = terms[t].value;
+            const PostingList &comps = _dVectors[terms[t].idNode];
 
-    //for (int m = 0; m < _dbSize; m++) {
-    //	//cout << "setting score for " << m << endl;
-    //	Matching& match = result.at( m );
-    //	DBElem elem = _catalog.get(m);
-    //	match.id = elem.id;
-    //	match.score = 2;
-    //}
+            if (comps.isDense()) {
+                // term(qi, di) accumulated for all the images of the block, merged below
+                Scoring::addDense(comps, b * SCORE_BLOCK, endId, qi, acc);
+                continue;
+            }
 
-    //cout << "non-zero count:" << _d_vectors.nzCount() << endl;
-    for (unsigned int idxNode = 0; idxNode < q.size(); idxNode++) {
-        float qi = q[idxNode];
-        if (qi > 0) {
+            // the cursor is the position of the next posting to be scored:
+            // postings blocks are decoded until one goes beyond the scores block
+            int end = comps.end();
+            int cursor = cursors[t];
+            while (cursor < end) {
 
-            vector<DComponent> &comps = _dVectors.at(idxNode);
-            for (unsigned int pos = 0; pos < comps.size(); pos++) {
+                int block = cursor / PostingList::BLOCK;
+                if (comps.blockFirstId(block) >= endId) {
+                    break;
+                }
 
-                DComponent &dc = comps.at(pos);
-                float di = dc.value;
-                float diff = abs(qi - di);
+                int count = comps.decodeBlock(block, ids, values);
+                int pos = cursor % PostingList::BLOCK;
+                for (; pos < count && ids[pos] < endId; pos++) {
 
-                Matching &match = result.at(dc.idFile);
-                match.id = dc.idFile;
+                    float di = values[pos];
 
-                match.score += (diff - di - qi); // L1
-                //match.score += (diff*diff - di*di - qi*qi); // L2
-                //match.score -= (2 * qi * di); // L2
+                    int idFile = ids[pos];
+                    if (stamps[idFile] != epoch) {
+                        stamps[idFile] = epoch;
+                        scores[idFile] = 2;
+                        touched[nTouched++] = idFile;
+                    }
 
+                    scores[idFile] -= 2 * Scoring::term(qi, di);
 
-            }
+                }
 
-        }
-    }
+                if (pos < count) {
+                    cursor = block * PostingList::BLOCK + pos;
+                    break;
+                }
+                cursor = (block + 1) * PostingList::BLOCK;
 
+            }
 
-    //Now, sort the matching vector from highest to lowest score
-    //int limit = 100;
-    //	Ptr< vector<Matching> > res = new vector<Matching>( min(_dbSize, limit); );
-    //	partial_sort_copy(result.begin(), result.end(), res->begin(), res->end());
+            cursors[t] = cursor;
 
-    sort(result.begin(), result.end());
-    if ((unsigned int) limit < result.size()) {
-        result.resize(limit);
-    }
+        }
 
+        // score decrease of the dense terms
+        if (anyDense) {
+            int startId = b * SCORE_BLOCK;
+            for (int idFile = startId; idFile < endId; idFile++) {
+                float m = acc[idFile - startId];
+                if (m <= 0) {
+                    continue;
+                }
+                acc[idFile - startId] = 0;
+                if (stamps[idFile] != epoch) {
+                    stamps[idFile] = epoch;
+                    scores[idFile] = 2;
+                    touched[nTouched++] = idFile;
+                }
+                scores[idFile] -= 2 * m;
+            }
+        }
 
-    double zeroEps = 1e-03;
-    int shrink = 0;
-    for (unsigned int i = 0; i < result.size(); i++) {
-        if (result[i].score < zeroEps) {
-            result[i].score = 0;
-        } else if (result[i].id == -1) {
-            shrink++;
+        ctx.blockTouched[b] = nTouched;
+
+        // scores of the block are final, updates the stripe top results
+        for (int i = 0; i < nTouched && limit > 0; i++) {
+            float score = scores[touched[i]];
+            if (nBest < limit) {
+                best[nBest++] = score;
+                push_heap(best, best + nBest);
+            } else if (score < best[0]) {
+                pop_heap(best, best + nBest);
+                best[nBest - 1] = score;
+                push_heap(best, best + nBest);
+            }
         }
-    }
-    if (shrink > 0) {
-        //cout << "shrinking" << shrink << endl;
-        result.resize(result.size() - shrink);
-    }
 
+    }
 
 }
 
@@ -1038,12 +3730,18 @@ VocTree::storeInfo(string &fileName) {
     FileStorage file(fileName, cv::FileStorage::WRITE);
     file << "k" << _k;
     file << "h" << _h;
+    file << "levelK" << _levelK;
     file << "useNorm" << _useNorm;
     file << "dbSize" << _dbSize;
     file << "nNodes" << _nNodes;
     file << "nextIdNode" << _usedNodes;
     file << "nextIdLeaf" << _usedLeaves;
     file << "totDescriptors" << _totDescriptors;
+    file << "vectorsFormat" << VECTORS_FORMAT;
+    file << "minLevel" << _minLevel;
+    file << "maxLevel" << _maxLevel;
+    file << "scoring" << _scoring;
+    file << "quantizer" << _quantizerSpec;
     //---
 
 }
@@ -1058,78 +3756,68 @@ void VocTree::storeVectors(string &fileName) {
         exit(-1);
     }
 
-    int elemSize = 4;
-    int bufferLen = 16 * MEGA;
-    void *pBuffer = malloc(bufferLen);
-    if (pBuffer == NULL) {
-        fclose(pFile);
-        cerr << "can't allocate memory" << endl;
-        exit(-1);
+    // compressed posting lists of each node, one after the other
+    for (unsigned int idx = 0; idx < _dVectors.size(); idx++) {
+        if (!_dVectors[idx].write(pFile)) {
+            fclose(pFile);
+            cerr << "can't write d-vectors file." << endl;
+            exit(-1);
+        }
     }
 
-    int *pInt = (int *) pBuffer;
-    float *pFloat = (float *) pBuffer;
+    fclose(pFile);
 
-    vector<DComponent> *pComps = NULL;
-    int pos = 0;
-    int cursor = 0;
-    bool onIdFile;
-    int size;
-    long written;
-    long bytes;
+}
 
-    unsigned int idx = 0;
 
-    while (idx < _dVectors.size()) {
+void
+VocTree::loadVectors(string &fileName) {
 
-        if (pComps == NULL) {
-            pComps = &(_dVectors.at(idx));
-            pos = 0;
-            size = pComps->size();
-            pInt[cursor++] = size;
-            onIdFile = true;
-        } else {
-            DComponent dc = pComps->at(pos);
-            if (onIdFile) {
-                pInt[cursor++] = dc.idFile;
-                onIdFile = false;
-            } else {
-                pFloat[cursor++] = dc.value;
-                onIdFile = true;
-                pos++;
-            }
-        }
+    if (_vectorsFormat == 0) {
+        // d-vectors stored with the raw format are compressed when they are loaded
+        loadRawVectors(fileName);
+        return;
+    }
 
-        bytes = elemSize * cursor;
-        if (bytes >= bufferLen) {
-            written = fwrite(pBuffer, 1, bytes, pFile);
-            assert(written == bytes);
-            cursor = 0;
-        }
+    if (_vectorsFormat != 1 && _vectorsFormat != VECTORS_FORMAT) {
+        cerr << "unsupported d-vectors format " << _vectorsFormat << ", the database must be rebuilt." << endl;
+        exit(-1);
+    }
 
-        if (pos >= size) {
-            // advance to the next d-components
-            pComps = NULL;
-            idx++;
-        }
+    FILE *pFile = fopen(fileName.c_str(), "rb");
 
+    if (pFile == 0) {
+        cerr << "can't read d-vectors file." << endl;
+        exit(-1);
     }
 
-    bytes = elemSize * cursor;
-    if (bytes > 0) {
-        written = fwrite(pBuffer, 1, bytes, pFile);
-        assert(written == bytes);
+    // lists stored before the dense layout (format 1) are all sparse,
+    // they are encoded again so that the high frequency nodes get the dense layout
+    bool sparseOnly = (_vectorsFormat == 1);
+    vector<Posting> comps;
+
+    _dVectors.clear();
+    _dVectors.resize(_usedNodes);
+    for (unsigned int idx = 0; idx < _dVectors.size(); idx++) {
+        PostingList &list = _dVectors[idx];
+        if (!(sparseOnly ? list.readSparse(pFile) : list.read(pFile))) {
+            fclose(pFile);
+            cerr << "can't read d-vectors file." << endl;
+            exit(-1);
+        }
+        if (sparseOnly && list.size() > 0) {
+            list.decode(comps);
+            list.encode(comps, _dbSize);
+        }
     }
 
-    free(pBuffer);
     fclose(pFile);
 
-
 }
 
 
 void
-VocTree::loadVectors(string &fileName) {
+VocTree::loadRawVectors(string &fileName) {
 
     FILE *pFile = fopen(fileName.c_str(), "rb");
 
@@ -1138,7 +3826,9 @@ VocTree::loadVectors(string &fileName) {
         exit(-1);
     }
 
+    _dVectors.clear();
     _dVectors.resize(_usedNodes);
+    vector<Posting> comps;
 
     int elemSize = 4;
     int bufferLen = 16 * MEGA;
@@ -1150,7 +3840,7 @@ VocTree::loadVectors(string &fileName) {
     }
     int *pInt = (int *) pBuffer;
     float *pFloat = (float *) pBuffer;
-    vector<DComponent> *pComps = NULL;
+    bool onComps = false;
     unsigned int idx = 0;
     int pos = 0;
     bool onIdFile;
@@ -1164,15 +3854,15 @@ VocTree::loadVectors(string &fileName) {
         int cursor = 0;
         while ((cursor * elemSize) < read) {
 
-            if (pComps == NULL) {
-                pComps = &(_dVectors.at(idx));
+            if (!onComps) {
+                onComps = true;
                 pos = 0;
                 size = pInt[cursor++];
-                pComps->resize(size);
+                comps.resize(size);
                 onIdFile = true;
             } else {
 
-                DComponent &dc = pComps->at(pos);
+                Posting &dc = comps.at(pos);
                 if (onIdFile) {
                     dc.idFile = pInt[cursor++];
                     onIdFile = false;
@@ -1184,8 +3874,9 @@ VocTree::loadVectors(string &fileName) {
             }
 
             if (pos >= size) {
-                // advance to the next d-components
-                pComps = NULL;
+                // compresses the d-components and advances to the next ones
+                _dVectors.at(idx).encode(comps, _dbSize);
+                onComps = false;
                 idx++;
             }
 
@@ -1321,16 +4012,24 @@ VocTree::loadInvIdx(string &fileName) {
 void
 VocTree::storeNodes(string &filePrefix) {
 
+    string fileChildren = filePrefix + ".children";
     string fileIdx = filePrefix + ".index";
     string fileLeaves = filePrefix + ".leaves";
     string fileCenters = filePrefix + ".centers";
 
     VecPersistor vp;
-    vp.persist(fileIdx, _index);
+    vp.persist(fileChildren, _firstChild);
     vp.persist(fileLeaves, _indexLeaves);
 
+    // centers rows are padded in memory, they are stored packed.
+    Mat centers = _centers.clone();
     MatPersistor mpc(fileCenters);
-    mpc.create(_centers);
+    mpc.create(centers);
+
+    // the old format index is not longer valid
+    if (FileHelper::exists(fileIdx)) {
+        FileHelper::deleteFile(fileIdx);
+    }
 
 }
 
@@ -1350,4 +4049,11 @@ VocTree::loadWeights(string &fileName) {
     mp.read(_weights);
     mp.close();
 
+    // nodes with no postings were stored with an infinite weight by previous versions
+    for (int n = 0; n < _weights.rows; n++) {
+        if (isinf(_weights.at<float>(n))) {
+            _weights.at<float>(n) = 0;
+        }
+    }
+
 }
@@ -17,6 +17,9 @@
 #include "Matching.h"
 #include "Catalog.h"
 #include "FileManager.h"
+#include "Distance.h"
+#include "PostingList.h"
+#include "Quantizer.h"
 
 
 using namespace cv;
@@ -27,24 +30,65 @@ class VocTree {
 
 public:
 
+    /**
+     * Norms used to score the images: the score of an image is the distance between
+     * the normalized query vector and the normalized image vector (see paper 4.1).
+     *  - SCORING_L1: L1 normalized vectors, L1 distance.
+     *  - SCORING_L2: L2 normalized vectors, squared L2 distance (computed with a dot product).
+     *  - SCORING_HELLINGER: square roots of the L1 normalized vectors, squared L2 distance.
+     */
+    enum {
+        SCORING_L1 = 0,
+        SCORING_L2 = 1,
+        SCORING_HELLINGER = 2
+    };
+
+    /**
+     * @param name scoring norm name (L1, L2 or HELLINGER, case insensitive)
+     * @return the scoring norm, or -1 if the name is unknown
+     */
+    static int getScoringType(string name);
+
+    /**
+     * @param scoring scoring norm
+     * @return the name of the scoring norm
+     */
+    static string getScoringName(int scoring);
+
+    /**
+     * Parses the quantizer of a vocabulary tree: "tree" for the tree descent, or "hnsw[:M[:efConstruction[:ef]]]"
+     * for an HNSW graph over the leaves (see useHnsw), by default hnsw:16:200:64.
+     * @param spec quantizer specification
+     * @param M output maximum number of neighbors of a word (0 for the tree descent)
+     * @param efConstruction output words explored when the graph is built
+     * @param ef output words explored by the searches
+     * @return false if the specification is not valid
+     */
+    static bool parseQuantizer(string spec, int &M, int &efConstruction, int &ef);
+
     /**
      *  Vocabulary tree constructor.
-     *  @param  k branch factor.
+     *  @param  levelK branch factor of each level, from the root (the last one is used for the deeper levels).
      *  @param  h maximum height for the tree.
      *  @param  images catalog of images.
      *  @param  dbPath path to database root.
      *  @param  reuseCenters reuses vocabulary
      *  @param  useNorm norm to compare features
+     *  @param  scoring norm used to score the images (see SCORING_L1)
+     *  @param  quantizer quantizer of the descriptors, used to index the images and by the queries
+     *          (see parseQuantizer)
      *
      */
 
     VocTree(
-            int k,
+            vector<int> &levelK,
             int h,
             Catalog<DBElem> &images,
             string &dbPath,
             bool reuseCenters,
-            int useNorm
+            int useNorm,
+            int scoring,
+            string &quantizer
 
     );
 
@@ -60,8 +104,124 @@ public:
      */
     virtual ~VocTree();
 
+    /**
+     * Scratch memory used by the queries.
+     * Buffers grow on the first queries and are reused afterwards, so that steady state queries
+     * do not allocate memory. A context must not be shared by concurrent queries (use one per thread).
+     */
+    struct QueryContext {
+
+        // paths of the query descriptors (see findPaths), with pathStride nodes per descriptor.
+        // For beam descents, votes holds the soft vote of each node of the paths
+        vector<int> paths;
+        vector<float> votes;
+        int pathStride;
+        bool soft;
+
+        // words of the query descriptors, when a quantizer is set (see setQuantizer),
+        // and the scratch of each quantization worker, created by the quantizer scratchOwner
+        vector<int> words;
+        vector<Ptr<Quantizer::Scratch> > quantizeScratch;
+        Ptr<Quantizer> scratchOwner;
+
+        // paths and votes of the chunks quantized so far by a deadline bounded query
+        vector<int> anytimePaths;
+        vector<float> anytimeVotes;
+
+        // batched descent scratch: (node, descriptor) pairs, gathered descriptors, products
+        // (a block of children at a time) and the closest child found so far of each descriptor
+        struct DescentScratch {
+            vector<pair<int, int> > active;
+            vector<pair<int, int> > next;
+            Mat group;
+            Mat products;
+            vector<int> bestChild;
+            vector<float> bestDist;
+            // beam descent: (node, vote) of the current and next beams, (distance, child) candidates
+            // and the distances to the children of a node
+            vector<pair<int, float> > beam;
+            vector<pair<int, float> > nextBeam;
+            vector<pair<float, int> > candidates;
+            vector<float> dists;
+        };
+        // one scratch per quantization worker
+        vector<DescentScratch> descent;
+
+        // query vector q, one entry per node. It is only used to accumulate the weights
+        // during the descent, and it is left zeroed at the end of each query.
+        vector<float> q;
+
+        // sparse query vector: the nodes visited by the query (sorted by id) with their q values
+        struct QTerm {
+            int idNode;
+            float value;
+        };
+        vector<int> visited;
+        vector<QTerm> terms;
+
+        // terms deeper than the cascade level, used by the second stage (see setCascade)
+        vector<QTerm> fineTerms;
+
+        // scores, one entry per database image. An entry is valid only if its stamp
+        // is the current query epoch, otherwise the score is the initial one (2).
+        vector<float> scores;
+        vector<unsigned int> stamps;
+        unsigned int epoch;
+
+        // images scored by the current query: the images touched in the scores block b
+        // are stored from touched[b * block size], and blockTouched[b] counts them
+        vector<int> touched;
+        vector<int> blockTouched;
+        vector<Matching> candidates;
+
+        // position of each posting list (one per term) reached by each scoring stripe
+        vector<int> cursors;
+
+        // for each scoring stripe, min(qi, di) accumulated by the dense posting lists
+        // over the images of the current scores block
+        vector<float> denseAcc;
+
+        // maximum number of results of the current query, and for each scoring stripe
+        // a heap (of limit elements) with the best scores found by the stripe
+        int limit;
+        vector<float> best;
+
+        QueryContext() : pathStride(0), soft(false), epoch(0), limit(0) {}
+
+    };
+
+    /**
+     * State of a streaming query over consecutive frames of a video (see queryStream).
+     * It keeps the query vector of the last frame and the dot product of each image with it,
+     * so that a new frame only applies the posting lists of the nodes whose value changed.
+     * A session must not be shared by concurrent streams.
+     */
+    struct StreamSession {
+
+        // scratch memory of the descent
+        QueryContext ctx;
+
+        // query vector of the last frame before normalization (sorted by node),
+        // and the changes of the current frame
+        vector<QueryContext::QTerm> values;
+        vector<QueryContext::QTerm> changes;
+
+        // dot product of each image with the unnormalized query vector.
+        // images holds the images with a dot product (those with listed[idFile] != 0)
+        vector<float> dots;
+        vector<int> images;
+        vector<unsigned char> listed;
+
+        // frames scored incrementally since the last full scoring
+        int frames;
+
+        StreamSession() : frames(0) {}
+
+    };
+
     /**
      * given a matrix with descriptors, performs a query with these descriptors
+     * (uses the vocabulary tree own query context)
      * @param queryDescrs input descriptors
      * @param reslt vector with the resulting scores
      * @param limit maximum number of results
@@ -70,12 +230,172 @@ public:
                vector<Matching> &result,
                int limit);
 
+    /**
+     * given a matrix with descriptors, performs a query with these descriptors
+     * @param queryDescrs input descriptors
+     * @param ctx query context providing the scratch memory
+     * @param reslt vector with the resulting scores
+     * @param limit maximum number of results
+     */
+    void query(Mat &queryDescrs,
+               QueryContext &ctx,
+               vector<Matching> &result,
+               int limit);
+
+    /**
+     * Warms up the vocabulary tree own query context: runs a query with the centers of the tree,
+     * with enough descriptors for every quantization thread, so that the scratch memory
+     * of the following queries is already allocated
+     * @param limit maximum number of results of the following queries
+     */
+    void warmQueryContext(int limit);
+
+    /**
+     * Deadline bounded query: descriptors are quantized in order, a chunk at a time,
+     * and no more chunks are quantized once the deadline has passed. The images are then scored
+     * with the descriptors quantized so far, so a valid result is always returned.
+     * The first chunk is small and it is always used (even if the deadline has already passed),
+     * the next chunks are sized to fit in the time left.
+     * Descriptors should be sorted from the most to the least relevant.
+     * (uses the vocabulary tree own query context)
+     * @param queryDescrs input descriptors
+     * @param result vector with the resulting scores
+     * @param limit maximum number of results
+     * @param deadline tick count (see cv::getTickCount) after which no more descriptors are quantized
+     * @return the number of descriptors used
+     */
+    int queryAnytime(Mat &queryDescrs,
+                     vector<Matching> &result,
+                     int limit,
+                     int64 deadline);
+
+    /**
+     * Performs a query with the visual words of the descriptors, as stored in the words file
+     * while indexing (see FileManager::WORDS), so the descriptors are not quantized again.
+     * The paths are the ones of the greedy descent used to index the images.
+     * (uses the vocabulary tree own query context)
+     * @param words leaf index of each descriptor (a CV_32S column)
+     * @param result vector with the resulting scores
+     * @param limit maximum number of results
+     */
+    void queryWords(Mat &words,
+                    vector<Matching> &result,
+                    int limit);
+
+    /**
+     * Streaming query: performs a query with the descriptors of a frame, updating the scores
+     * of the previous frame of the session with the nodes whose value changed.
+     * Results are the same as the ones of query(). With the L1 scoring the normalized terms
+     * depend on the whole query vector, so every frame is scored from scratch.
+     * @param queryDescrs input descriptors of the frame
+     * @param session streaming session (see StreamSession)
+     * @param result vector with the resulting scores
+     * @param limit maximum number of results
+     */
+    void queryStream(Mat &queryDescrs,
+                     StreamSession &session,
+                     vector<Matching> &result,
+                     int limit);
+
+    /**
+     * @return true if the streaming queries score each frame with the changes since the previous one,
+     *         false if the scoring norm (L1) makes them score every frame from scratch (see queryStream)
+     */
+    bool isStreamIncremental();
+
+    /**
+     * given several matrices with descriptors, performs a query for each one of them.
+     * Queries are processed in groups: the descriptors of a group are quantized together,
+     * and the d-vector of each visited node is read once for all the queries of the group.
+     * The group is scored by stripes of image blocks in parallel, with the block pruning of query().
+     * @param queries input descriptors of each query
+     * @param results vector with the resulting scores of each query
+     * @param limit maximum number of results per query
+     */
+    void queryBatch(vector<Mat> &queries,
+                    vector<vector<Matching> > &results,
+                    int limit);
+
     /**
      * updates the vocabulary tree with new images
      * @param images images catalog
      */
     void update(Catalog<DBElem> &images);
 
+    /**
+     * Sets the window of levels used for scoring (the root is the level 0).
+     * Nodes out of the window are ignored by the queries, and their d-vectors are not stored.
+     * D-vectors are recomputed and stored.
+     * @param minLevel first level used for scoring
+     * @param maxLevel last level used for scoring
+     */
+    void setScoringLevels(int minLevel, int maxLevel);
+
+    /**
+     * Recomputes the d-vectors and displays the levels statistics (see showLevels)
+     */
+    void reportLevels();
+
+    /**
+     * Sets the beam used to quantize the query descriptors (images are always indexed greedily).
+     * With a beam, the descent keeps up to width nodes per level instead of only the closest one,
+     * and every reached node gets a soft vote. A width of 1 restores the greedy descent.
+     * @param width maximum number of nodes kept per level
+     * @param ratio children farther than ratio times the distance of the closest one are dropped
+     *              (0 keeps the width closest children)
+     */
+    void setBeam(int width, float ratio);
+
+    /**
+     * Sets the cascade scoring. The first stage scores all the images only with the nodes
+     * up to the given level (short posting lists), and the best candidates are rescored with the
+     * deeper nodes, read per image from a forward index (built here from the d-vectors).
+     * The final scores of the candidates are the same as without the cascade.
+     * @param level last level of the first stage (0 disables the cascade)
+     * @param candidates number of candidates rescored by the second stage
+     */
+    void setCascade(int level, int candidates);
+
+    /**
+     * Enables or disables the 8 bits copy of the centers used by the descent (float L2 descriptors only).
+     * Each dimension is quantized with its own offset and scale. The descent compares the codes,
+     * and only when the closest children are too close to be told apart by the codes
+     * they are compared with the float centers, so the chosen child is the same as without codes.
+     * While the codes are used, the descent compares every descriptor with the codes at all the levels,
+     * the matrix multiplication of the batched descent (which reads the float centers) is not used.
+     * @param enable true to build and use the codes, false to release them
+     */
+    void useQuantizedCenters(bool enable);
+
+    /**
+     * Sets the quantizer used to find the words of the descriptors (by the queries, and by the images
+     * indexed afterwards). The paths are rebuilt from the words, so the descriptors are scored with the
+     * same weights and inverted index. Queries with a quantizer do not use the beam.
+     * The quantizer of the database (see parseQuantizer) is set when the tree is built or loaded.
+     * @param quantizer the quantizer, or an empty pointer to use the tree descent
+     */
+    void setQuantizer(Ptr<Quantizer> quantizer);
+
+    /**
+     * Uses an HNSW graph over the leaves centers to quantize the queries (see HnswQuantizer).
+     * The graph is loaded from the data directory if it was built with the same parameters,
+     * otherwise it is built and stored.
+     * @param M maximum number of neighbors of a word (0 restores the tree descent)
+     * @param efConstruction words explored when the graph is built
+     * @param ef words explored by the queries
+     */
+    void useHnsw(int M, int efConstruction, int ef);
+
+    /**
+     * Compares the quantizers on the given descriptors: for the tree descent and the HNSW graph
+     * (with several values of ef) displays the recall@1 (the fraction of descriptors that get the
+     * closest leaf, found by an exhaustive search) and the time per descriptor on a single thread.
+     * @param descriptors descriptors used for the comparison
+     * @param M maximum number of neighbors of a word of the graph
+     * @param efConstruction words explored when the graph is built
+     */
+    void benchmarkQuantizers(Mat &descriptors, int M, int efConstruction);
+
     /**
      * saves the vocabulary tree to disk
      */
@@ -95,7 +415,9 @@ private:
     // path where vocabulary tree is stored
     string _path;
 
-    // Branch factor
+    // Branch factor of each level (_levelK[l] is the number of children of the nodes of the level l),
+    // and the maximum of them
+    vector<int> _levelK;
     int _k;
     // Maximum height for the tree
     int _h;
@@ -113,29 +435,136 @@ private:
     // Data type of the visual words (see OpenCV data types)
     int _centType;
 
+    // Distance kernels used on the descent for float L2 descriptors and binary descriptors
+    // (both NULL if the generic cv::norm must be used)
+    Distance::L2SqrKernel _l2Sqr;
+    Distance::HammingKernel _hamming;
+
+    // Closest child kernels specialized for the branch factor of each level and the descriptor size
+    // (NULL if there is no specialization for them, see Distance::closestL2).
+    // The descent scans every descriptor of a level with its kernel, even the groups large enough
+    // for the matrix multiplication. Binary descriptors never use the matrix multiplication
+    vector<Distance::ClosestL2Kernel> _closestL2;
+    vector<Distance::ClosestHammingKernel> _closestHamming;
+
+    // squared L2 norm of each center (only used for float L2 descriptors),
+    // used by the batched descent: ||q - c||^2 = ||q||^2 + ||c||^2 - 2 q.c
+    vector<float> _centerNorms;
+
+    // 8 bits copy of the centers (see useQuantizedCenters): center n is approximated by
+    // _codeMin + _codeScale * codes(n), per dimension. _codeWeights are the squared scales and
+    // _codeError bounds the L2 distance between a center and its approximation.
+    // _l2SqrU8 is NULL when the codes are not used.
+    Mat _centerCodes;
+    vector<float> _codeMin;
+    vector<float> _codeInvScale;
+    vector<float> _codeWeights;
+    float _codeError;
+    Distance::L2SqrU8Kernel _l2SqrU8;
+
     // Number of indexed images
     int _dbSize;
 
+    // Window of levels used for scoring
+    int _minLevel;
+    int _maxLevel;
+
+    // norm used to score the images (see SCORING_L1)
+    int _scoring;
+
+    // cascade scoring (see setCascade): last level of the first stage (0 if disabled),
+    // and number of candidates of the second stage
+    int _cascadeLevel;
+    int _cascadeCandidates;
+
+    // level of each node (the root is the level 0), see computeNodeLevels
+    vector<unsigned char> _nodeLevels;
+
+    // forward index of the nodes deeper than the cascade level: the (node, value) components
+    // of image i are stored from _forwardStart[i] to _forwardStart[i + 1]
+    vector<int> _forwardStart;
+    vector<int> _forwardNodes;
+    vector<float> _forwardValues;
+
+    // Beam used to quantize the queries (see setBeam)
+    int _beamWidth;
+    float _beamRatio;
+
+    // quantizer of the descriptors (see setQuantizer), empty for the tree descent,
+    // and the quantizer of the database, stored with the info (see parseQuantizer)
+    Ptr<Quantizer> _quantizer;
+    string _quantizerSpec;
+
+    // quantizers over the leaves: the batched descent, and the exhaustive search (see benchmarkQuantizers)
+    class TreeQuantizer;
+    class ExactQuantizer;
+
+    // statistics of a level of the tree, computed with the d-vectors
+    struct LevelStats {
+        // number of nodes, and number of nodes with postings
+        int nodes;
+        int usedNodes;
+        // number of postings (d-vector components)
+        double postings;
+        // sum of the weights of the used nodes
+        double weights;
+        // score mass: sum of the (not normalized) d-vectors values
+        double mass;
+    };
+    vector<LevelStats> _levelStats;
+
     // Number of indexed descriptors
     int _totDescriptors;
 
-    // nodes index
-    // since the vocabulary tree is not a <K,H> complete tree, only the used nodes indices are stored
-    // in this _index vector. _index vector length will be the number of used nodes.
-    vector<int> _index;
+    // nodes table
+    // nodes are numbered from 0 (the root) to _usedNodes - 1 in breadth first order.
+    // The K children of a node have consecutive ids, _firstChild stores in each position
+    // the id of the first child of that node, or (-1) if that node is a leaf.
+    // Since the vocabulary tree is not a <K,H> complete tree, only the used nodes are stored.
+    vector<int> _firstChild;
 
     // leafs indices
-    // _indexLeaves vector has the same length than _index.
+    // _indexLeaves vector has the same length than _firstChild.
     // It stores in each position a (-1) value if that position corresponds to an internal node and
     // the stores the id of leaf node if that position corresponds to a leaf node.
     vector<int> _indexLeaves;
 
+    // inverse maps used to rebuild the paths of the stored words (see queryWords):
+    // the parent of each node (-1 for the root), and the node of each leaf index
+    vector<int> _parents;
+    vector<int> _leafNodes;
+
     // nodes information
-    // _centers: Mat in R^(_usedNodes x D), stores the nodes centers (or visual words)
+    // _centers: Mat in R^(_usedNodes x D), stores the nodes centers (or visual words).
+    //           Rows are padded and aligned to the cache line, so the centers of the children
+    //           of a node form a single aligned block. Memory is owned by _centersBuffer.
     // _weights: Mat in R^_usedNodes, stores the nodes weights
     Mat _centers;
+    Mat _centersBuffer;
     Mat _weights;
 
+    // query context used by query() when no context is given
+    QueryContext _queryCtx;
+
+    // query contexts used by queryBatch(), one per query of a group
+    vector<QueryContext> _batchCtx;
+
+    // merged terms of a group of queries: the visited nodes sorted by id and, for the node n,
+    // the queries that visited it (and their q values) from _batchStarts[n] to _batchStarts[n + 1]
+    vector<int> _batchNodes;
+    vector<int> _batchStarts;
+    vector<int> _batchSlots;
+    vector<float> _batchValues;
+
+    // position of each merged posting list reached by each scoring stripe,
+    // and the values of a dense list decoded by each stripe for an image block
+    vector<int> _batchCursors;
+    vector<float> _batchDense;
+
+    // when nodes are loaded from the old format (complete tree index),
+    // it stores for each node its old row (used to reorder weights and d-vectors)
+    vector<int> _legacyOrder;
+
     // for virtual inverted indexes (IIF: Inverted Index File)
     struct IIFEntry {
         int idFile;
@@ -154,6 +583,24 @@ private:
      */
     bool isLeaf(int idNode);
 
+    /**
+     * @param idNode internal node
+     * @return the number of children of idNode (the branch factor of its level)
+     */
+    int childCount(int idNode);
+
+    /**
+     * Sets the branch factor of each level
+     * @param levelK branch factors from the root (the last one is used for the deeper levels).
+     *        If it is empty, _k is used for all the levels
+     */
+    void setLevelK(const vector<int> &levelK);
+
+    /**
+     * Computes the level of each node (_nodeLevels) from the nodes table
+     */
+    void computeNodeLevels();
+
     /**
      * used to create sequential nodes ids, and increments _usedNodes
      * @return the next id node to be used
@@ -167,20 +614,224 @@ private:
     int getNextIdxLeaf();
 
     /**
-     * given a node id, and a child position 0 <= numChild < K, it returns the id of that child node
-     * @param idNode input parent id node
-     * @param numChild number of child
-     * @return the id node of that child
+     * creates a new node at the end of the nodes table
+     * @param center the center (visual word) of the node
+     * @return the id of the new node
      */
-    int idChild(int idNode, int numChild);
+    int newNode(const Mat &center);
 
+    /**
+     * Renumbers the nodes in breadth first order, so that the children of each node are contiguous
+     * and the upper levels of the tree are stored together.
+     */
+    void layoutNodes();
 
-    // used to store the d vectors
-    struct DComponent {
-        int idFile;
-        float value;
-    };
-    vector<vector<DComponent> > _dVectors;
+    /**
+     * Rewrites the nodes tables (leaves and centers) following a new numbering
+     * @param order for each new node id, the id of that node on the current tables
+     * @param firstChild the first child table using the new ids
+     */
+    void reorderNodes(vector<int> &order, vector<int> &firstChild);
+
+    /**
+     * Removes the subtrees with no postings once the inverted indexes are built.
+     * A node with no postings whose parent has postings is kept as a leaf (the descent still
+     * compares it with its siblings), and its descendants are removed. The nodes, the leaves,
+     * the weights, the d-vectors, the inverted indexes and the words file are renumbered.
+     * @return true if some node was removed
+     */
+    bool compactNodes();
+
+    /**
+     * Copies the centers into a cache line aligned buffer with padded rows, and uses it as _centers
+     * @param centers the centers to be copied
+     */
+    void alignCenters(Mat &centers);
+
+
+    // d vectors: for each node, the compressed list of its components
+    // (an image id and a value for each image that has descriptors through the node)
+    vector<PostingList> _dVectors;
+
+    // format of the d-vectors file that was loaded (see VECTORS_FORMAT)
+    int _vectorsFormat;
+
+    /**
+     * Computes the sparse and normalized query vector (ctx.terms) of a query
+     * @param ctx query context where the query vector is stored
+     * @param source query context with the paths of the descriptors (see findPaths)
+     * @param rowStart first descriptor of the query
+     * @param rowEnd last descriptor of the query (not included)
+     */
+    void computeTerms(QueryContext &ctx, const QueryContext &source, int rowStart, int rowEnd);
+
+    /**
+     * Computes the sparse query vector (ctx.terms) of a query, without normalizing it
+     * @param ctx query context where the query vector is stored
+     * @param source query context with the paths of the descriptors (see findPaths)
+     * @param rowStart first descriptor of the query
+     * @param rowEnd last descriptor of the query (not included)
+     * @return the sum of the query vector values
+     */
+    double collectTerms(QueryContext &ctx, const QueryContext &source, int rowStart, int rowEnd);
+
+    /**
+     * Adds the d-vector of a node, multiplied by a value, to the dot products of a stream
+     * @param session streaming session
+     * @param idNode node
+     * @param value value multiplied by the d-vector components
+     */
+    void applyStreamTerm(StreamSession &session, int idNode, float value);
+
+    /**
+     * Prepares the scores of a context for a new query
+     * @param ctx query context
+     * @return the number of image blocks
+     */
+    int prepareScores(QueryContext &ctx);
+
+    /**
+     * Selects the best scored images of a query
+     * @param ctx query context with the scores
+     * @param result vector with the resulting scores
+     * @param limit maximum number of results
+     */
+    void selectResults(QueryContext &ctx, vector<Matching> &result, int limit);
+
+    /**
+     * Scores the images with the query vector of the context (ctx.terms) and selects the results
+     * @param ctx query context
+     * @param result vector with the resulting scores
+     * @param limit maximum number of results
+     */
+    void scoreQuery(QueryContext &ctx, vector<Matching> &result, int limit);
+
+    /**
+     * First stage of the cascade scoring: moves the terms deeper than the cascade level
+     * to ctx.fineTerms (see setCascade)
+     * @param ctx query context with the query terms
+     * @param limit maximum number of results
+     * @return true if the query uses the cascade
+     */
+    bool splitCascade(QueryContext &ctx, int limit);
+
+    /**
+     * Rescores the first stage candidates with the fine terms and keeps the best ones (see setCascade)
+     * @param ctx query context with the fine terms
+     * @param result first stage candidates, replaced by the final results
+     * @param limit maximum number of results
+     */
+    void finishCascade(QueryContext &ctx, vector<Matching> &result, int limit);
+
+    /**
+     * Second stage of the cascade scoring: adds the terms deeper than the cascade level
+     * to the scores of the candidates (see setCascade)
+     * @param ctx query context, with the deep terms of the query
+     * @param candidates candidates of the first stage, their scores are updated
+     */
+    template<class Scoring>
+    void rescoreCandidates(QueryContext &ctx, vector<Matching> &candidates);
+
+    /**
+     * Builds the forward index of the nodes deeper than the cascade level (see setCascade)
+     */
+    void buildForwardIndex();
+
+    // parallel body used to score the image blocks (see scoreStripe)
+    class ScoringBody;
+
+    // parallel body used to score the image blocks for the queries of a group (see scoreBatchStripe)
+    class BatchScoringBody;
+
+    /**
+     * Accumulates the scores of the images of a stripe (a range of consecutive image blocks)
+     * for the query terms stored in the context. Stripes write disjoint parts of the context,
+     * so they can be scored in parallel.
+     * Once a stripe has found ctx.limit images, an image block is skipped when the maximum values
+     * of the posting blocks overlapping it show that none of its images can enter the stripe top results.
+     * @param ctx query context with the query terms
+     * @param stripe stripe to be scored
+     * @param nStripes number of stripes the image blocks are divided into
+     * @param nBlocks number of image blocks
+     */
+    void scoreStripe(QueryContext &ctx, int stripe, int nStripes, int nBlocks);
+
+    /**
+     * Scores a stripe with the accumulation policy of the scoring norm (see scoreStripe).
+     * Each policy provides the term of an image score decrease (see MinScoring and DotScoring).
+     */
+    template<class Scoring>
+    void scoreStripeWith(QueryContext &ctx, int stripe, int nStripes, int nBlocks);
+
+    /**
+     * Accumulates the scores of the images of a stripe for the queries of a group (see queryBatch),
+     * with the merged terms of the group (_batchNodes). Each posting block overlapping an image block
+     * is decoded once and applied to all the queries that visited its node, and a query skips
+     * the image blocks that can not enter its stripe top results (see scoreStripe).
+     * @param count number of queries of the group (contexts in _batchCtx)
+     * @param stripe stripe to be scored
+     * @param nStripes number of stripes the image blocks are divided into
+     * @param nBlocks number of image blocks
+     */
+    void scoreBatchStripe(int count, int stripe, int nStripes, int nBlocks);
+
+    /**
+     * Scores a stripe for a group with the accumulation policy of the scoring norm (see scoreBatchStripe)
+     */
+    template<class Scoring>
+    void scoreBatchStripeWith(int count, int stripe, int nStripes, int nBlocks);
+
+    /**
+     * Normalizes a component of a vector with the scoring norm (see SCORING_L1)
+     * @param value component to be normalized
+     * @param sum sum of the components of the vector (L1, Hellinger) or of their squares (L2)
+     * @return the normalized component
+     */
+    float normalizeValue(float value, double sum);
+
+    /**
+     * Selects the distance kernels to be used on the descent according to the norm and the centers type
+     */
+    void selectKernels();
+
+    /**
+     * Builds the 8 bits copy of the centers (see useQuantizedCenters)
+     */
+    void quantizeCenters();
+
+    /**
+     * Builds the parent of each node and the node of each leaf index (see queryWords)
+     */
+    void mapLeaves();
+
+    /**
+     * Rebuilds the greedy paths of the given words, going up from the leaves to the root
+     * @param words leaf index of each descriptor (descriptors with an invalid word get no path)
+     * @param rows number of descriptors
+     * @param ctx query context where the paths are stored (_h + 1 nodes per descriptor)
+     */
+    void wordPaths(const int *words, int rows, QueryContext &ctx);
+
+    /**
+     * Sets the quantizer of the database (_quantizerSpec), building its graph if needed
+     */
+    void applyQuantizer();
+
+    /**
+     * Looks for the child of the node idNode whose center is the closest to the given descriptor
+     * @param descriptor input descriptor
+     * @param idNode id of the (internal) parent node
+     * @return the id of the closest child
+     */
+    int findClosestChild(Mat &descriptor, int idNode);
+
+    /**
+     * Computes the distances from the given descriptor to all the children of the node idNode
+     * @param descriptor input descriptor
+     * @param idNode id of the (internal) parent node
+     * @param dists output distances (room for _k elements)
+     */
+    void childDistances(Mat &descriptor, int idNode, float *dists);
 
     /**
      * Traverses the tree moving from the root to the leaves looking for the closest visual word in each step
@@ -190,11 +841,48 @@ private:
     int findLeaf(Mat &descriptor);
 
     /**
-     * Traverses the tree moving from the root to the leaves looking for the closest visual word in each step
-     * @param descriptor input descriptor
-     * @return the path from the root to the leaf found, stored as a list of nodes indexes
+     * Traverses the tree for all the given descriptors at once, level by level.
+     * At each level the descriptors are grouped by their current node, and for float L2 descriptors
+     * the distances of a whole group to the children centers are computed as ||c||^2 - 2 Q.C^T
+     * with a single matrix multiplication. Small groups and other norms use the per descriptor descent.
+     * Large queries are split in chunks of descriptors that are quantized in parallel.
+     * @param descriptors input descriptors (one per row)
+     * @param ctx query context. Output paths are stored in ctx.paths with a stride of ctx.pathStride
+     *            nodes per descriptor: the path of descriptor i starts at paths[i * pathStride] (the root)
+     *            and ends at its leaf; remaining positions are filled with (-1)
+     * @param useBeam if a beam is set (see setBeam), uses the beam descent (see descendBeam)
+     * If a quantizer is set (see setQuantizer), the paths are the ones of the words it finds.
+     */
+    void findPaths(Mat &descriptors, QueryContext &ctx, bool useBeam);
+
+    // parallel body used to quantize chunks of descriptors (see descend)
+    class DescentBody;
+
+    /**
+     * Batched descent of a range of descriptors (see findPaths)
+     * @param descriptors input descriptors (one per row)
+     * @param rowStart first descriptor to quantize
+     * @param rowEnd last descriptor to quantize (not included)
+     * @param scratch descent scratch memory
+     * @param paths output paths, with a stride of _h + 1 nodes per descriptor
      */
-    list<int> findPath(Mat &queryDescr);
+    void descend(Mat &descriptors, int rowStart, int rowEnd,
+                 QueryContext::DescentScratch &scratch, vector<int> &paths);
+
+    /**
+     * Beam descent of a range of descriptors (see findPaths).
+     * At each level, the children of all the nodes of the beam compete, and the closest ones
+     * (up to _beamWidth, within _beamRatio) form the next beam. The vote reaching a level is shared
+     * among its nodes in inverse proportion to their distances, so a descriptor votes as much as
+     * with the greedy descent, spread over the near-ties.
+     * @param descriptors input descriptors (one per row)
+     * @param rowStart first descriptor to quantize
+     * @param rowEnd last descriptor to quantize (not included)
+     * @param scratch descent scratch memory
+     * @param ctx query context where the paths and votes are stored (ctx.pathStride nodes per descriptor)
+     */
+    void descendBeam(Mat &descriptors, int rowStart, int rowEnd,
+                     QueryContext::DescentScratch &scratch, QueryContext &ctx);
 
 
     /**
@@ -211,20 +899,33 @@ private:
 
     /**
      * Stores vocabulary tree nodes data to disk.
-     * Nodes data (nodes indices, leaves indices and centers) are in three different output files
-     * <prefix>+".index", <prefix>+".leaves", <prefix>+".centers" respectively.
+     * Nodes data (first children, leaves indices and centers) are in three different output files
+     * <prefix>+".children", <prefix>+".leaves", <prefix>+".centers" respectively.
      * @param prefix naming the output files
      */
     void storeNodes(string &prefix);
 
     /**
      * Loads vocabulary tree nodes data from disk.
-     * Nodes data (nodes indices, leaves indices and centers) are in three different output files
-     * <prefix>+".index", <prefix>+".leaves", <prefix>+".centers" respectively.
+     * Nodes data (first children, leaves indices and centers) are in three different output files
+     * <prefix>+".children", <prefix>+".leaves", <prefix>+".centers" respectively.
+     * If nodes are stored in the old format (<prefix>+".index") they are converted.
      * @param prefix naming the input files
      */
     void loadNodes(string &prefix);
 
+    /**
+     * Loads vocabulary tree nodes stored in the old format (complete tree index)
+     * and converts them to the current nodes table.
+     * @param prefix naming the input files
+     */
+    void loadLegacyNodes(string &prefix);
+
+    /**
+     * Reorders weights and d-vectors loaded from a database stored in the old format
+     */
+    void reorderVectors();
+
 
     /**
      * Stores nodes weights data to disk
@@ -262,6 +963,12 @@ private:
      */
     void loadVectors(string &fileName);
 
+    /**
+     * Loads d-vectors data stored with the raw format (uncompressed components) and compresses them
+     * @param fileName input file name
+     */
+    void loadRawVectors(string &fileName);
+
 
     /**
      * Given an input file (containing a Mat with descriptors), it builds the node idNode, on the level level
@@ -347,13 +1054,6 @@ private:
      */
     void createNode(int idNode, int level, string &descrFile);
 
-    /**
-     * Enlarges a given Mat, if it has less than rows rows, preserving its contents
-     * @param mat the Mat to be enlarged
-     * @param rows the resulting number of rows that Mat will have
-     */
-    void expand(Mat &mat, int rows);
-
     /**
      * Indexes image elements into the tree starting from startImage within the catalog
      * @param catalog the input catalog with the elements to be indexed
@@ -366,13 +1066,21 @@ private:
      */
     void computeVectors();
 
+    /**
+     * Displays the statistics of each level computed with the d-vectors:
+     * nodes, postings and score mass, so that the scoring levels window can be chosen.
+     */
+    void showLevels();
+
     /**
      * Computes inverted index for the node idNode
      * @param idNode id of the node where to compute the inverted index
      * @param level level of the node where to compute the inverted index
      * @param outInvIdx resulting inverted index
+     * @param dVectors uncompressed d-vectors, where the d-vector of the node is stored
      */
-    void computeInvertedIndex(int idNode, int level, vector<IIFEntry> &outInvIdx);
+    void computeInvertedIndex(int idNode, int level, vector<IIFEntry> &outInvIdx,
+                              vector<vector<Posting> > &dVectors);
 
     /**
      * builds all the nodes of the Vocabulary Tree
@@ -53,10 +53,20 @@ void printHelpBuild(string cmd) {
     cout << endl;
     cout << "\t" << "[-vtp <K>:<H>]: vocabulary tree parameters." << endl;
     cout << "\t\t" << "where K is the branch factor, and H is the maximum height for the tree." << endl;
+    cout << "\t\t" << "K can be a comma separated list with the branch factor of each level from the root" << endl;
+    cout << "\t\t" << "(the last one is used for the deeper levels), for example 64,10:4." << endl;
+    cout << "\t\t" << "a wide first level gives a shallower tree, its centers are compared in batches." << endl;
     cout << endl;
     cout << "\t" << "[-pca N]: if specified pca is applied over the extracted descriptors." << endl;
     cout << "\t\t" << "Dimensions are reduced to N." << endl;
     cout << endl;
+    cout << "\t" << "[-scoring <NORM>]: norm used to score the images: L1, L2 or HELLINGER." << endl;
+    cout << "\t\t" << "default norm is L1" << endl;
+    cout << endl;
+    cout << "\t" << "[-quantizer <QUANTIZER>]: search of the visual word of the descriptors (indexing and queries)." << endl;
+    cout << "\t\t" << "tree (the tree descent) or hnsw[:M[:EFC[:EF]]] (a graph over the leaves)." << endl;
+    cout << "\t\t" << "default quantizer is tree, hnsw defaults are 16:200:64" << endl;
+    cout << endl;
     cout << "---" << endl;
     cout << endl;
     cout << "\t" << "example:" << endl;
@@ -92,8 +102,12 @@ void printHelpBuild(string cmd) {
  *                      See FeaturesMethod.h for available feature detector and extractors.
  *              [-vtp <K>:<H>]: vocabulary tree parameters.
  *                      where K is the branch factor, and H is the maximum height for the tree.
+ *                      K can be a comma separated list with the branch factor of each level
+ *                      (the last one is used for the deeper levels).
  *              [-pca N]: if specified pca is applied over the extracted descriptors.
  *                          Dimensions are reduced to N.
+ *              [-scoring <NORM>]: norm used to score the images (L1, L2 or HELLINGER), default is L1.
+ *              [-quantizer <QUANTIZER>]: quantizer of the descriptors (tree or hnsw[:M[:EFC[:EF]]]), default is tree.
  *
  */
 void buildDatabase(string dbPath, int argc, char **argv) {
@@ -103,6 +117,18 @@ void buildDatabase(string dbPath, int argc, char **argv) {
     string method = "SIFT:SIFT";
     string vtParams = "10:6";
     string strPCA = "0";
+    string scoringName = "L1";
+    string quantizer = "tree";
+
+    // the scoring norm and the quantizer can follow any of the other parameters
+    for (int i = 3; i + 1 < argc; i++) {
+        if (strcasecmp(argv[i], "-scoring") == 0) {
+            scoringName = argv[i + 1];
+        }
+        if (strcasecmp(argv[i], "-quantizer") == 0) {
+            quantizer = argv[i + 1];
+        }
+    }
 
     if (argc >= 4) {
 
@@ -147,20 +173,44 @@ void buildDatabase(string dbPath, int argc, char **argv) {
         cerr << "invalid voctree parameters" << endl;
         return;
     }
-    int k = atoi(vtParams.substr(0, pos).c_str());
+    // the branch factor can be a list, one per level from the root
+    vector<int> levelK;
+    string strK = vtParams.substr(0, pos) + ",";
+    for (int start = 0, end; (end = strK.find(",", start)) != -1; start = end + 1) {
+        int k = atoi(strK.substr(start, end - start).c_str());
+        if (k < 2) {
+            cerr << "invalid voctree parameters, branch factors must be at least 2" << endl;
+            return;
+        }
+        levelK.push_back(k);
+    }
     int h = atoi(vtParams.substr(pos + 1).c_str());
     int pca = atoi(strPCA.c_str());
 
+    int scoring = VocTree::getScoringType(scoringName);
+    if (scoring == -1) {
+        cerr << "invalid scoring norm" << endl;
+        return;
+    }
+
+    int hnswM, hnswEfConstruction, hnswEf;
+    if (!VocTree::parseQuantizer(quantizer, hnswM, hnswEfConstruction, hnswEf)) {
+        cerr << "invalid quantizer" << endl;
+        return;
+    }
+
     cout << "building database " << dbPath << "..." << endl << flush;
     cout << "feature method: " << method << endl << flush;
-    cout << "voctree: k:" << k << " h: " << h << endl << flush;
+    cout << "voctree: k:" << vtParams.substr(0, pos) << " h: " << h << endl << flush;
+    cout << "scoring norm: " << VocTree::getScoringName(scoring) << endl << flush;
+    cout << "quantizer: " << quantizer << endl << flush;
 
     FeatureMethod fm(detectorType, extractorType);
     int maxFiles = 0;
     int maxFilesVocabulary = 0;
     bool reuseVocabulary = reuseFeatures;
 
-    Database::build(dbPath, fm, reuseFeatures, k, h, maxFiles, maxFilesVocabulary, reuseVocabulary, pca);
+    Database::build(dbPath, fm, reuseFeatures, levelK, h, maxFiles, maxFilesVocabulary, reuseVocabulary, pca, scoring, quantizer);
     cout << "build done." << endl << flush;
 
 
@@ -193,6 +243,9 @@ void printHelpUpdate() {
     cout << endl;
     cout << "\t" << "[-vtp <K>:<H>]: vocabulary tree parameters." << endl;
     cout << "\t\t" << "where K is the branch factor, and H is the maximum height for the tree." << endl;
+    cout << "\t\t" << "K can be a comma separated list with the branch factor of each level from the root" << endl;
+    cout << "\t\t" << "(the last one is used for the deeper levels), for example 64,10:4." << endl;
+    cout << "\t\t" << "a wide first level gives a shallower tree, its centers are compared in batches." << endl;
     cout << endl;
     cout << "\t" << "[-pca N]: if specified pca is applied over the extracted descriptors." << endl;
     cout << "\t\t" << "Dimensions are reduced to N." << endl;
@@ -220,6 +273,119 @@ int updateDatabase(string dbPath) {
 
 
 
+/**
+ * Prints help for the scoring levels
+ * @param cmd command line name
+ */
+void printHelpLevels(string cmd) {
+
+    cout << "---" << endl;
+    cout << "option \"-levels\": reports or sets the levels of the vocabulary tree used for scoring" << endl;
+    cout << "parameters: " << endl;
+    cout << "\t" << "[<MIN>:<MAX>]: first and last levels used for scoring (the root is the level 0)." << endl;
+    cout << "\t\t" << "Upper levels have postings for almost every image and discriminate little." << endl;
+    cout << "\t\t" << "If not specified, a report with the score mass of each level is displayed." << endl;
+    cout << "---" << endl;
+    cout << endl;
+    cout << "\t" << "example:" << endl;
+    cout << "\t" << cmd << " -levels /home/myuser/mydb 2:6" << endl;
+    cout << endl;
+    cout << "---" << endl;
+
+}
+
+/**
+ * levelsDatabase: reports or sets the window of levels used for scoring
+ *
+ * @param dbPath path where database root is placed in the filesystem
+ * @param argc parameters count received from command line
+ * @param argv parameters: [<MIN>:<MAX>] levels window
+ */
+int levelsDatabase(string dbPath, int argc, char **argv) {
+
+    Ptr<Database> db = Database::load(dbPath);
+
+    if (argc < 4) {
+        db->reportLevels();
+        return 0;
+    }
+
+    string levels = argv[3];
+    int pos = levels.find(":");
+    if (pos == -1) {
+        cerr << "invalid levels" << endl;
+        return -1;
+    }
+    int minLevel = atoi(levels.substr(0, pos).c_str());
+    int maxLevel = atoi(levels.substr(pos + 1).c_str());
+
+    cout << "setting scoring levels " << minLevel << " to " << maxLevel << "..." << endl << flush;
+    db->setScoringLevels(minLevel, maxLevel);
+    cout << "levels done." << endl << flush;
+    return 0;
+
+}
+
+
+/**
+ * Prints help for the quantizers comparison
+ * @param cmd command line name
+ */
+void printHelpQuantizers(string cmd) {
+
+    cout << "---" << endl;
+    cout << "option \"-quantizers\": compares the recall and the speed of the quantizers of the query descriptors" << endl;
+    cout << "parameters: " << endl;
+    cout << "\t" << "[<SAMPLES>]: number of indexed descriptors used (default 10000)." << endl;
+    cout << "\t" << "[<M>:<EFC>]: neighbors per word and efConstruction of the HNSW graph (default 16:200)." << endl;
+    cout << "\t\t" << "Recall@1 is the fraction of descriptors that get their closest visual word." << endl;
+    cout << "---" << endl;
+    cout << endl;
+    cout << "\t" << "example:" << endl;
+    cout << "\t" << cmd << " -quantizers /home/myuser/mydb 10000 16:200" << endl;
+    cout << endl;
+    cout << "---" << endl;
+
+}
+
+/**
+ * quantizersDatabase: compares the tree descent and the HNSW graph on the indexed descriptors
+ *
+ * @param dbPath path where database root is placed in the filesystem
+ * @param argc parameters count received from command line
+ * @param argv parameters: [<SAMPLES>] [<M>:<EFC>]
+ */
+int quantizersDatabase(string dbPath, int argc, char **argv) {
+
+    int samples = 10000;
+    int M = 16;
+    int efConstruction = 200;
+
+    if (argc >= 4) {
+        samples = atoi(argv[3]);
+    }
+    if (argc >= 5) {
+        string params = argv[4];
+        int pos = params.find(":");
+        if (pos == -1) {
+            cerr << "invalid hnsw parameters" << endl;
+            return -1;
+        }
+        M = atoi(params.substr(0, pos).c_str());
+        efConstruction = atoi(params.substr(pos + 1).c_str());
+    }
+    if (samples <= 0 || M <= 0 || efConstruction <= 0) {
+        cerr << "invalid quantizers parameters" << endl;
+        return -1;
+    }
+
+    Ptr<Database> db = Database::load(dbPath);
+    db->benchmarkQuantizers(samples, M, efConstruction);
+    return 0;
+
+}
+
+
 /**
  * Prints usage
  * @param cmd command line name
@@ -243,7 +409,10 @@ void printHelpOptions(string cmd) {
     cout << "\t" << "-start: starts server for receiving queries" << endl;
     cout << "\t" << "-stop: stops server" << endl;
     cout << "\t" << "-query: does a query" << endl;
+    cout << "\t" << "-stream: does a query for each frame of a video" << endl;
     cout << "\t" << "-unlock: unlocks server" << endl;
+    cout << "\t" << "-levels: reports or sets the tree levels used for scoring" << endl;
+    cout << "\t" << "-quantizers: compares the quantizers of the query descriptors" << endl;
     cout << endl;
     cout << "\t" << "for specific option parameters run:" << endl;
     cout << "\t" << cmd << " -help <option>" << endl;
@@ -307,6 +476,25 @@ void printHelpQuery(string cmd) {
 }
 
 
+void printHelpStream(string cmd) {
+
+    cout << "---" << endl;
+    cout << "option \"-stream\": performs a query for each frame of a video" << endl;
+    cout << "parameters: " << endl;
+    cout << "\t" << "<video file>: video to be queried" << endl;
+    cout << "\t" << "resulting columns are: frame number, score, file id, file name" << endl;
+    cout << "\t" << "frames are scored incrementally only on databases built with the L2 or HELLINGER" << endl;
+    cout << "\t\t" << "scoring norms. With L1 (the default norm) every frame is a full query." << endl;
+    cout << "---" << endl;
+    cout << endl;
+    cout << "\t" << "example:" << endl;
+    cout << "\t" << cmd << " -stream /home/myuser/mydb /home/myuser/mydb/queries/video1.mp4" << endl;
+    cout << endl;
+    cout << "---" << endl;
+
+}
+
+
 void printHelp(string cmd, string option) {
 
 
@@ -337,6 +525,18 @@ void printHelp(string cmd, string option) {
     if (strcasecmp(option.c_str(), "query") == 0) {
         printHelpQuery(cmd);
     }
+    else
+    if (strcasecmp(option.c_str(), "stream") == 0) {
+        printHelpStream(cmd);
+    }
+    else
+    if (strcasecmp(option.c_str(), "levels") == 0) {
+        printHelpLevels(cmd);
+    }
+    else
+    if (strcasecmp(option.c_str(), "quantizers") == 0) {
+        printHelpQuantizers(cmd);
+    }
     else {
 
         cerr << "unknown option" << endl;
@@ -418,6 +618,14 @@ int main(int argc, char **argv) {
         cout << getState(dbPath) << endl;
     }
     else
+    if (strcasecmp(option.c_str(), "-levels") == 0) {
+        levelsDatabase(dbPath, argc, argv);
+    }
+    else
+    if (strcasecmp(option.c_str(), "-quantizers") == 0) {
+        quantizersDatabase(dbPath, argc, argv);
+    }
+    else
     if (strcasecmp(option.c_str(), "-query") == 0) {
 
         if (argc < 4) {
@@ -430,6 +638,20 @@ int main(int argc, char **argv) {
 
         runQuery(dbPath, query);
 
+    }
+    else
+    if (strcasecmp(option.c_str(), "-stream") == 0) {
+
+        if (argc < 4) {
+            cerr << "ERR: must specify the video" << endl;
+            printHelpStream(cmd);
+
+            return -1;
+        }
+        string video = argv[3];
+
+        runStream(dbPath, video);
+
     }
     else {
 